@@ -33,9 +33,13 @@
 #include "cr.h"
 #include "debug.h"
 #include "libdill.h"
+#include "poller.h"
+#include "shchan.h"
+#include "slab.h"
 #include "utils.h"
 
 DILL_CT_ASSERT(sizeof(struct dill_choosedata) <= DILL_OPAQUE_SIZE);
+DILL_CT_ASSERT(sizeof(struct dill_selectdata) <= DILL_OPAQUE_SIZE);
 
 static const int dill_chan_type_placeholder = 0;
 static const void *dill_chan_type = &dill_chan_type_placeholder;
@@ -48,38 +52,328 @@ static const struct hvfptrs dill_chan_vfptrs = {
     dill_chan_dump
 };
 
-int dill_channel(size_t itemsz, size_t bufsz, const char *created) {
-    /* If there's at least one channel created in the user's code
-       we want the debug functions to get into the binary. */
-    dill_preserve_debug();
-    /* Allocate the channel structure followed by the item buffer. */
-    struct dill_chan *ch = (struct dill_chan*)
-        malloc(sizeof(struct dill_chan) + (itemsz * bufsz));
-    if(!ch) {errno = ENOMEM; return -1;}
+static const int dill_selector_type_placeholder = 0;
+static const void *dill_selector_type = &dill_selector_type_placeholder;
+
+static void dill_selector_close(int h);
+static void dill_selector_dump(int h);
+
+static const struct hvfptrs dill_selector_vfptrs = {
+    dill_selector_close,
+    dill_selector_dump
+};
+
+/* Returns index of the clause in the pollset. */
+static int dill_choose_index(struct dill_clause *cl) {
+    struct dill_choosedata *cd = (struct dill_choosedata*)cl->cr->opaque;
+    return cl - cd->clauses;
+}
+
+/* Resumes the coroutine blocked on the clause. The clause may belong either
+   to a choose() or to a selector. */
+static void dill_trigger(struct dill_clause *cl, int error) {
+    cl->error = error;
+    if(dill_fast(cl->cr)) {
+        dill_resume(cl->cr, dill_choose_index(cl));
+        return;
+    }
+    struct dill_selclause *scl = dill_cont(cl, struct dill_selclause, cl);
+    dill_resume(scl->sel->cr, scl - scl->sel->clauses);
+}
+
+/* Returns a clause blocked on the endpoint or NULL if there's none.
+   A selector is considered blocked on all of its clauses while there's
+   a coroutine waiting for it. */
+static struct dill_clause *dill_ep_peer(struct dill_ep *ep) {
+    if(!dill_list_empty(&ep->clauses))
+        return dill_cont(dill_list_begin(&ep->clauses),
+            struct dill_clause, epitem);
+    if(dill_fast(!ep->blocked))
+        return NULL;
+    struct dill_list_item *it;
+    for(it = dill_list_begin(&ep->watchers); it; it = dill_list_next(it)) {
+        struct dill_selclause *scl = dill_cont(it, struct dill_selclause,
+            watchitem);
+        if(scl->sel->cr)
+            return &scl->cl;
+    }
+    return NULL;
+}
+
+/* Lets the selectors watching the endpoint know that the state of
+   the channel have changed. */
+static void dill_ep_notify(struct dill_ep *ep) {
+    /* Once all the watchers are marked as ready there's nothing to do till
+       a selector finds out that one of them would block. */
+    if(dill_fast(!ep->unready))
+        return;
+    ep->unready = 0;
+    struct dill_list_item *it;
+    for(it = dill_list_begin(&ep->watchers); it; it = dill_list_next(it)) {
+        struct dill_selclause *scl = dill_cont(it, struct dill_selclause,
+            watchitem);
+        if(!dill_list_item_inlist(&scl->readyitem))
+            dill_list_insert(&scl->sel->ready, &scl->readyitem, NULL);
+    }
+}
+
+/* Size of a segment of an unbounded channel, including the header.
+   Segments of this size are recycled via the pool below. Channels with items
+   too large to fit into a segment use one-item segments allocated directly
+   from the heap. */
+#define DILL_CHSEG_SIZE 4096
+
+/* Maximum number of unused cached segments. */
+static int dill_max_cached_chsegs = 64;
+
+/* A stack of unused segments shared by all unbounded channels. */
+static int dill_num_cached_chsegs = 0;
+static struct dill_slist dill_cached_chsegs = {0};
+
+static void dill_chseg_atexit(void) {
+    while(!dill_slist_empty(&dill_cached_chsegs))
+        free(dill_slist_pop(&dill_cached_chsegs));
+}
+
+/* Size of a segment of the channel in bytes. */
+static size_t dill_chseg_size(struct dill_chan *ch) {
+    return sizeof(struct dill_chseg) + ch->segitems * ch->sz;
+}
+
+static struct dill_chseg *dill_chseg_alloc(struct dill_chan *ch) {
+    if(dill_fast(dill_chseg_size(ch) <= DILL_CHSEG_SIZE &&
+          !dill_slist_empty(&dill_cached_chsegs))) {
+        --dill_num_cached_chsegs;
+        struct dill_slist_item *it = dill_slist_pop(&dill_cached_chsegs);
+        return dill_cont(it, struct dill_chseg, item);
+    }
+    struct dill_chseg *seg = malloc(dill_chseg_size(ch) <= DILL_CHSEG_SIZE ?
+        DILL_CHSEG_SIZE : dill_chseg_size(ch));
+    if(dill_slow(!seg)) {errno = ENOMEM; return NULL;}
+    dill_slist_item_init(&seg->item);
+    return seg;
+}
+
+static void dill_chseg_free(struct dill_chan *ch, struct dill_chseg *seg) {
+    if(dill_slow(dill_chseg_size(ch) > DILL_CHSEG_SIZE ||
+          dill_num_cached_chsegs >= dill_max_cached_chsegs)) {
+        free(seg);
+        return;
+    }
+    /* Clean-up function to delete the cached segments at exit. It is not
+       strictly necessary but valgrind will be happy about it. */
+    static int atexit_registered = 0;
+    if(dill_slow(!atexit_registered)) {
+        int rc = atexit(dill_chseg_atexit);
+        dill_assert(rc == 0);
+        atexit_registered = 1;
+    }
+    /* LIFO order means the segment we get next is likely still cached. */
+    dill_slist_push(&dill_cached_chsegs, &seg->item);
+    ++dill_num_cached_chsegs;
+}
+
+/* Size of the channel structure including the item buffer. Unbounded
+   channels have no fixed buffer. */
+static size_t dill_chan_size(size_t itemsz, size_t bufsz, size_t segitems) {
+    return sizeof(struct dill_chan) + (segitems ? 0 : itemsz * bufsz);
+}
+
+static struct dill_chan *dill_chan_alloc(size_t itemsz, size_t bufsz,
+      size_t segitems) {
+    /* Allocate the channel structure followed by the item buffer. Channels
+       are often short-lived so small ones are taken from a slab. */
+    struct dill_chan *ch = (struct dill_chan*)dill_slab_alloc(
+        dill_chan_size(itemsz, bufsz, segitems));
+    if(dill_slow(!ch)) return NULL;
     ch->sz = itemsz;
     ch->sender.seq = 0;
     dill_list_init(&ch->sender.clauses);
+    dill_list_init(&ch->sender.watchers);
+    ch->sender.blocked = 0;
+    ch->sender.unready = 0;
     ch->receiver.seq = 0;
     dill_list_init(&ch->receiver.clauses);
+    dill_list_init(&ch->receiver.watchers);
+    ch->receiver.blocked = 0;
+    ch->receiver.unready = 0;
+    ch->high.seq = 0;
+    dill_list_init(&ch->high.clauses);
+    dill_list_init(&ch->high.watchers);
+    ch->high.blocked = 0;
+    ch->high.unready = 0;
+    ch->low.seq = 0;
+    dill_list_init(&ch->low.clauses);
+    dill_list_init(&ch->low.watchers);
+    ch->low.blocked = 0;
+    ch->low.unready = 0;
     ch->done = 0;
     ch->bufsz = bufsz;
     ch->items = 0;
     ch->first = 0;
+    ch->segitems = segitems;
+    ch->last = 0;
+    dill_slist_init(&ch->segs);
+    ch->hwm = 0;
+    ch->lwm = 0;
+    ch->congested = 0;
+    ch->policy = CHBLOCK;
+    ch->dropped = 0;
+    ch->ticker = NULL;
+    ch->stats = NULL;
+    return ch;
+}
+
+static int dill_chan_handle(struct dill_chan *ch, const char *created) {
     /* Allocate a handle to point to the channel. */
     int h = dill_handle(dill_chan_type, ch, &dill_chan_vfptrs, created);
     if(dill_slow(h < 0)) {
         int err = errno;
-        free(ch);
+        dill_slab_free(ch, dill_chan_size(ch->sz, ch->bufsz, ch->segitems));
         errno = err;
         return -1;
     }
     return h;
 }
 
-/* Returns index of the clause in the pollset. */
-static int dill_choose_index(struct dill_clause *cl) {
-    struct dill_choosedata *cd = (struct dill_choosedata*)cl->cr->opaque;
-    return cl - cd->clauses;
+int dill_channel(size_t itemsz, size_t bufsz, const char *created) {
+    /* If there's at least one channel created in the user's code
+       we want the debug functions to get into the binary. */
+    dill_preserve_debug();
+    struct dill_chan *ch = dill_chan_alloc(itemsz, bufsz, 0);
+    if(dill_slow(!ch)) return -1;
+    return dill_chan_handle(ch, created);
+}
+
+int dill_uchannel(size_t itemsz, size_t limit, const char *created) {
+    dill_preserve_debug();
+    /* Fit as many items into a segment as possible, but at least one. */
+    size_t segitems = (DILL_CHSEG_SIZE - sizeof(struct dill_chseg)) /
+        (itemsz ? itemsz : 1);
+    if(!segitems)
+        segitems = 1;
+    struct dill_chan *ch = dill_chan_alloc(itemsz,
+        limit ? limit : SIZE_MAX, segitems);
+    if(dill_slow(!ch)) return -1;
+    return dill_chan_handle(ch, created);
+}
+
+/* Returns statistics of the channel or NULL if they are not being collected.
+   If allocation of the statistics fails they are silently not collected. */
+static struct chstats *dill_chan_stats(struct dill_chan *ch) {
+    if(dill_fast(!dill_chstats_enabled)) return NULL;
+    if(dill_slow(!ch->stats))
+        ch->stats = calloc(1, sizeof(struct chstats));
+    return ch->stats;
+}
+
+/* Records an operation that found 'items' messages in the channel. */
+static void dill_chan_occupancy(struct chstats *st, size_t items) {
+    int i = 0;
+    while(items && i < CHSTATS_BUCKETS - 1) {
+        items >>= 1;
+        ++i;
+    }
+    ++st->occupancy[i];
+}
+
+/* Records the time a clause spent blocked on the channel. */
+static void dill_chan_blocked(struct dill_clause *cl, int64_t ms) {
+    struct chstats *st = dill_chan_stats(cl->ch);
+    if(dill_slow(!st)) return;
+    if(cl->op == CHSEND)
+        st->send_blocked += ms;
+    else if(cl->op == CHRECV)
+        st->recv_blocked += ms;
+}
+
+/* Switches the channel between congested and relieved state and resumes
+   the clauses waiting for the new state. */
+static void dill_chan_congest(struct dill_chan *ch, int congested) {
+    ch->congested = congested;
+    struct dill_ep *ep = congested ? &ch->high : &ch->low;
+    while(!dill_list_empty(&ep->clauses))
+        dill_trigger(dill_cont(dill_list_begin(&ep->clauses),
+            struct dill_clause, epitem), 0);
+}
+
+/* Stores a message into the channel's buffer. The caller must ensure that
+   the limit is not exceeded. Fails with ENOMEM if an unbounded channel
+   needs a new segment and there's no memory for it. */
+static int dill_chan_push(struct dill_chan *ch, const void *val) {
+    dill_assert(ch->items < ch->bufsz);
+    dill_ep_notify(&ch->receiver);
+    if(!ch->segitems) {
+        /* Avoid division; first + items < 2 * bufsz. */
+        size_t pos = ch->first + ch->items;
+        if(pos >= ch->bufsz)
+            pos -= ch->bufsz;
+        dill_chan_copy(((char*)(ch + 1)) + (pos * ch->sz), val, ch->sz);
+        ++ch->items;
+        if(dill_slow(ch->hwm && !ch->congested && ch->items >= ch->hwm))
+            dill_chan_congest(ch, 1);
+        return 0;
+    }
+    struct dill_chseg *seg = dill_cont(ch->segs.last, struct dill_chseg, item);
+    if(!seg || ch->last == ch->segitems) {
+        seg = dill_chseg_alloc(ch);
+        if(dill_slow(!seg)) return -1;
+        dill_slist_push_back(&ch->segs, &seg->item);
+        ch->last = 0;
+    }
+    dill_chan_copy(((char*)(seg + 1)) + (ch->last * ch->sz), val, ch->sz);
+    ++ch->last;
+    ++ch->items;
+    if(dill_slow(ch->hwm && !ch->congested && ch->items >= ch->hwm))
+        dill_chan_congest(ch, 1);
+    return 0;
+}
+
+/* Retrieves the oldest message from the channel's buffer. */
+static void dill_chan_pop(struct dill_chan *ch, void *val) {
+    dill_assert(ch->items > 0);
+    dill_ep_notify(&ch->sender);
+    if(dill_slow(ch->congested && ch->items - 1 <= ch->lwm))
+        dill_chan_congest(ch, 0);
+    if(!ch->segitems) {
+        dill_chan_copy(val, ((char*)(ch + 1)) + (ch->first * ch->sz),
+            ch->sz);
+        if(dill_slow(++ch->first == ch->bufsz))
+            ch->first = 0;
+        --ch->items;
+        return;
+    }
+    struct dill_chseg *seg = dill_cont(dill_slist_begin(&ch->segs),
+        struct dill_chseg, item);
+    dill_chan_copy(val, ((char*)(seg + 1)) + (ch->first * ch->sz), ch->sz);
+    ++ch->first;
+    --ch->items;
+    /* If the channel is empty, keep the last segment around but rewind it.
+       That way a channel oscillating around zero doesn't touch the pool. */
+    if(!ch->items) {
+        ch->first = 0;
+        ch->last = 0;
+        return;
+    }
+    /* Return fully consumed segments to the pool. */
+    if(ch->first == ch->segitems) {
+        dill_slist_pop(&ch->segs);
+        dill_chseg_free(ch, seg);
+        ch->first = 0;
+    }
+}
+
+/* Detaches all the selector clauses from the endpoint. The clauses
+   report EPIPE from then on. */
+static void dill_ep_detach(struct dill_ep *ep) {
+    while(!dill_list_empty(&ep->watchers)) {
+        struct dill_selclause *scl = dill_cont(dill_list_begin(&ep->watchers),
+            struct dill_selclause, watchitem);
+        dill_list_erase(&ep->watchers, &scl->watchitem);
+        scl->cl.ch = NULL;
+        if(!dill_list_item_inlist(&scl->readyitem))
+            dill_list_insert(&scl->sel->ready, &scl->readyitem, NULL);
+    }
 }
 
 static void dill_chan_close(int h) {
@@ -87,95 +381,215 @@ static void dill_chan_close(int h) {
     dill_assert(ch);
     /* Resume any remaining senders and receivers on the channel
        with EPIPE error. */
-    while(!dill_list_empty(&ch->sender.clauses)) {
-        struct dill_clause *cl = dill_cont(dill_list_begin(
-            &ch->sender.clauses), struct dill_clause, epitem);
-        cl->error = EPIPE;
-        dill_resume(cl->cr, dill_choose_index(cl));
+    struct dill_clause *cl;
+    while((cl = dill_ep_peer(&ch->sender)))
+        dill_trigger(cl, EPIPE);
+    while((cl = dill_ep_peer(&ch->receiver)))
+        dill_trigger(cl, EPIPE);
+    while((cl = dill_ep_peer(&ch->high)))
+        dill_trigger(cl, EPIPE);
+    while((cl = dill_ep_peer(&ch->low)))
+        dill_trigger(cl, EPIPE);
+    dill_ep_detach(&ch->sender);
+    dill_ep_detach(&ch->receiver);
+    if(ch->ticker) {
+        dill_timer_purge(&ch->ticker->timer);
+        free(ch->ticker);
     }
-    while(!dill_list_empty(&ch->receiver.clauses)) {
-        struct dill_clause *cl = dill_cont(
-            dill_list_begin(&ch->receiver.clauses), struct dill_clause, epitem);
-        cl->error = EPIPE;
-        dill_resume(cl->cr, dill_choose_index(cl));
+    /* Release the segments of an unbounded channel. */
+    while(!dill_slist_empty(&ch->segs)) {
+        struct dill_slist_item *it = dill_slist_pop(&ch->segs);
+        dill_chseg_free(ch, dill_cont(it, struct dill_chseg, item));
     }
-    free(ch);
+    free(ch->stats);
+    dill_slab_free(ch, dill_chan_size(ch->sz, ch->bufsz, ch->segitems));
 }
 
 static void dill_chan_dump(int h) {
     struct dill_chan *ch = hdata(h, dill_chan_type);
     dill_assert(ch);
-    fprintf(stderr, "  CHANNEL item-size:%zu items:%zu/%zu done:%d\n",
-        ch->sz, ch->items, ch->bufsz, ch->done);
+    if(ch->segitems) {
+        fprintf(stderr, "  CHANNEL item-size:%zu items:%zu/unbounded "
+            "limit:%zu done:%d\n", ch->sz, ch->items,
+            ch->bufsz == SIZE_MAX ? 0 : ch->bufsz, ch->done);
+    }
+    else {
+        fprintf(stderr, "  CHANNEL item-size:%zu items:%zu/%zu done:%d\n",
+            ch->sz, ch->items, ch->bufsz, ch->done);
+    }
+    if(ch->ticker)
+        fprintf(stderr, "    ticker period:%lldus\n",
+            (long long)ch->ticker->period);
+    if(ch->hwm)
+        fprintf(stderr, "    watermarks:%zu/%zu congested:%d\n", ch->hwm,
+            ch->lwm, ch->congested);
+    if(ch->policy || ch->dropped)
+        fprintf(stderr, "    policy:%s dropped:%llu\n",
+            ch->policy == CHOVERWRITE ? "overwrite" :
+            ch->policy == CHDROP ? "drop" : "block",
+            (unsigned long long)ch->dropped);
+    struct chstats *st = ch->stats;
+    if(!st)
+        return;
+    fprintf(stderr, "    sent:%llu received:%llu send-blocked:%lldms "
+        "recv-blocked:%lldms hwm:%zu occupancy:",
+        (unsigned long long)st->sent, (unsigned long long)st->received,
+        (long long)st->send_blocked, (long long)st->recv_blocked, st->hwm);
+    int i;
+    for(i = 0; i != CHSTATS_BUCKETS; ++i)
+        fprintf(stderr, "%s%llu", i ? "," : "",
+            (unsigned long long)st->occupancy[i]);
+    fprintf(stderr, "\n");
+}
+
+int chstats(int h, struct chstats *stats) {
+    struct dill_chan *ch = hdata(h, dill_chan_type);
+    if(dill_slow(!ch)) return -1;
+    if(dill_slow(!stats)) {errno = EINVAL; return -1;}
+    if(ch->stats)
+        *stats = *ch->stats;
+    else
+        memset(stats, 0, sizeof(struct chstats));
+    stats->dropped = ch->dropped;
+    return 0;
 }
 
 static struct dill_ep *dill_getep(struct dill_clause *cl) {
-    return cl->op == CHSEND ?
-        &cl->ch->sender : &cl->ch->receiver;
+    switch(cl->op) {
+    case CHSEND:
+        return &cl->ch->sender;
+    case CHRECV:
+        return &cl->ch->receiver;
+    case CHHIGH:
+        return &cl->ch->high;
+    default:
+        return &cl->ch->low;
+    }
+}
+
+/* Watermark clauses don't transfer any messages. */
+#define dill_iswm(cl) ((cl)->op == CHHIGH || (cl)->op == CHLOW)
+
+#define dill_isfd(cl) ((cl)->op == CHFDIN || (cl)->op == CHFDOUT)
+
+static int dill_fdevents(struct dill_clause *cl) {
+    return cl->op == CHFDIN ? FDW_IN : FDW_OUT;
 }
 
 static void dill_choose_unblock_cb(struct dill_cr *cr) {
     struct dill_choosedata *cd = (struct dill_choosedata*)cr->opaque;
+    /* The coroutine was blocked on all the channels in the pollset. */
+    int64_t blocked = dill_slow(cd->since >= 0) ? now() - cd->since : -1;
     int i;
     for(i = 0; i != cd->nclauses; ++i) {
         struct dill_clause *cl = &cd->clauses[i];
+        if(dill_slow(dill_isfd(cl))) {
+            dill_fdwait_rm(cl->h, dill_fdevents(cl));
+            continue;
+        }
+        if(dill_slow(blocked >= 0))
+            dill_chan_blocked(cl, blocked);
         dill_list_erase(&dill_getep(cl)->clauses, &cl->epitem);
     }
-    if(cd->ddline > 0)
+    cr->fd_cb = NULL;
+    if(cd->ddline >= 0)
         dill_timer_rm(&cr->timer);
 }
 
+/* Invoked by the poller when one of the file descriptors is ready. */
+static void dill_choose_fd_cb(struct dill_cr *cr, int fd, int events) {
+    struct dill_choosedata *cd = (struct dill_choosedata*)cr->opaque;
+    int i;
+    for(i = 0; i != cd->nclauses; ++i) {
+        struct dill_clause *cl = &cd->clauses[i];
+        if(!dill_isfd(cl) || cl->h != fd ||
+              !(events & (dill_fdevents(cl) | FDW_ERR)))
+            continue;
+        if(cl->val)
+            *(int*)cl->val = events;
+        dill_trigger(cl, 0);
+        return;
+    }
+    dill_assert(0);
+}
+
 /* Push new item to the channel. */
-static void dill_enqueue(struct dill_chan *ch, void *val) {
+static int dill_enqueue(struct dill_chan *ch, void *val) {
+    struct chstats *st = dill_chan_stats(ch);
     /* If there's a receiver already waiting, let's resume it. */
-    if(!dill_list_empty(&ch->receiver.clauses)) {
+    struct dill_clause *cl = dill_ep_peer(&ch->receiver);
+    if(cl) {
         dill_assert(ch->items == 0);
-        struct dill_clause *cl = dill_cont(
-            dill_list_begin(&ch->receiver.clauses), struct dill_clause, epitem);
-        memcpy(cl->val, val, ch->sz);
-        cl->error = 0;
-        dill_resume(cl->cr, dill_choose_index(cl));
-        return;
+        dill_chan_copy(cl->val, val, ch->sz);
+        dill_trigger(cl, 0);
+        if(dill_slow(st)) {
+            dill_chan_occupancy(st, 0);
+            ++st->sent;
+            ++st->received;
+        }
+        return 0;
+    }
+    /* Lossy channel is full. Either replace the oldest message or throw away
+       the new one. Number of messages in the buffer doesn't change. */
+    if(dill_slow(ch->items == ch->bufsz)) {
+        dill_assert(ch->policy != CHBLOCK && !ch->segitems);
+        ++ch->dropped;
+        if(ch->policy == CHOVERWRITE) {
+            dill_chan_copy(((char*)(ch + 1)) + (ch->first * ch->sz), val,
+                ch->sz);
+            if(++ch->first == ch->bufsz)
+                ch->first = 0;
+            if(dill_slow(st))
+                ++st->sent;
+        }
+        return 0;
     }
     /* Write the value to the buffer. */
-    assert(ch->items < ch->bufsz);
-    size_t pos = (ch->first + ch->items) % ch->bufsz;
-    memcpy(((char*)(ch + 1)) + (pos * ch->sz) , val, ch->sz);
-    ++ch->items;
+    size_t items = ch->items;
+    int rc = dill_chan_push(ch, val);
+    if(dill_slow(st && rc == 0)) {
+        dill_chan_occupancy(st, items);
+        ++st->sent;
+        if(ch->items > st->hwm)
+            st->hwm = ch->items;
+    }
+    return rc;
 }
 
 /* Pop one value from the channel. */
 static void dill_dequeue(struct dill_chan *ch, void *val) {
+    struct chstats *st = dill_chan_stats(ch);
+    if(dill_slow(st)) {
+        dill_chan_occupancy(st, ch->items);
+        ++st->received;
+    }
     /* Get a blocked sender, if any. */
-    struct dill_clause *cl = dill_cont(
-        dill_list_begin(&ch->sender.clauses), struct dill_clause, epitem);
+    struct dill_clause *cl = dill_ep_peer(&ch->sender);
     if(!ch->items) {
         /* If chdone was already called we can return the value immediately.
            There are no senders waiting to send. */
         if(dill_slow(ch->done)) {
             dill_assert(!cl);
-            memcpy(val, ((char*)(ch + 1)) + (ch->bufsz * ch->sz), ch->sz);
+            dill_chan_copy(val, ((char*)(ch + 1)) + (ch->bufsz * ch->sz),
+                ch->sz);
             return;
         }
         /* Otherwise there must be a sender waiting to send. */
         dill_assert(cl);
-        memcpy(val, cl->val, ch->sz);
-        cl->error = 0;
-        dill_resume(cl->cr, dill_choose_index(cl));
+        dill_chan_copy(val, cl->val, ch->sz);
+        dill_trigger(cl, 0);
+        if(dill_slow(st))
+            ++st->sent;
         return;
     }
     /* If there's a value in the buffer start by retrieving it. */
-    memcpy(val, ((char*)(ch + 1)) + (ch->first * ch->sz), ch->sz);
-    ch->first = (ch->first + 1) % ch->bufsz;
-    --ch->items;
-    /* And if there was a sender waiting, unblock it. */
-    if(cl) {
-        assert(ch->items < ch->bufsz);
-        size_t pos = (ch->first + ch->items) % ch->bufsz;
-        memcpy(((char*)(ch + 1)) + (pos * ch->sz) , cl->val, ch->sz);
-        ++ch->items;
-        cl->error = 0;
-        dill_resume(cl->cr, dill_choose_index(cl));
+    dill_chan_pop(ch, val);
+    /* And if there was a sender waiting, unblock it. If an unbounded channel
+       can't get memory for the message the sender simply stays blocked. */
+    if(cl && dill_fast(dill_chan_push(ch, cl->val) == 0)) {
+        dill_trigger(cl, 0);
+        if(dill_slow(st))
+            ++st->sent;
     }
 }
 
@@ -187,26 +601,74 @@ static int dill_choose_error(struct dill_clause *cl) {
     case CHSEND:
         if(cl->ch->done)
             return EPIPE;
-        if(dill_list_empty(&cl->ch->receiver.clauses) &&
-              cl->ch->items == cl->ch->bufsz)
+        if(cl->ch->items == cl->ch->bufsz && !cl->ch->policy &&
+              !dill_ep_peer(&cl->ch->receiver))
             return EAGAIN;
         return 0;
     case CHRECV:
-        if(!dill_list_empty(&cl->ch->sender.clauses) ||
-              cl->ch->items > 0)
+        if(cl->ch->items > 0 || dill_ep_peer(&cl->ch->sender))
             return 0;
         if(cl->ch->done)
             return EPIPE;
         return EAGAIN;
+    case CHHIGH:
+        if(cl->ch->done)
+            return EPIPE;
+        return cl->ch->congested ? 0 : EAGAIN;
+    case CHLOW:
+        if(cl->ch->done)
+            return EPIPE;
+        return cl->ch->congested ? EAGAIN : 0;
     default:
         dill_assert(0);
     }
 }
 
-static int dill_choose_(struct chclause *clauses, int nclauses,
-      int64_t deadline) {
+/* Ways to pick one of the clauses that are available at the same time. */
+#define DILL_CHOOSE_UNIFORM 0
+#define DILL_CHOOSE_FIRST 1
+#define DILL_CHOOSE_WEIGHTED 2
+
+/* Picks one of the available clauses. 'cls[0..available).aidx' are indices
+   of the available clauses in ascending order. Returns the index of the
+   chosen clause. */
+static int dill_choose_pick(struct dill_clause *cls, int available, int mode,
+      const int *weights) {
+    if(available == 1 || mode == DILL_CHOOSE_FIRST)
+        return cls[0].aidx;
+    if(mode == DILL_CHOOSE_WEIGHTED) {
+        uint64_t total = 0;
+        int i;
+        for(i = 0; i != available; ++i)
+            total += weights[cls[i].aidx];
+        /* If all the available clauses have zero weight, any of them will
+           do. Weights larger than 2^32 in sum get coarser resolution. */
+        if(total > 0) {
+            int shift = 0;
+            while((total >> shift) > UINT32_MAX)
+                ++shift;
+            uint64_t r = (uint64_t)dill_rand((uint32_t)(total >> shift)) <<
+                shift;
+            for(i = 0; i != available; ++i) {
+                uint64_t w = weights[cls[i].aidx];
+                if(r < w)
+                    return cls[i].aidx;
+                r -= w;
+            }
+            /* Rounding due to the shift may leave r past the last clause. */
+            return cls[available - 1].aidx;
+        }
+    }
+    return cls[dill_rand(available)].aidx;
+}
+
+/* The deadline is in microseconds. */
+static int dill_choose_(struct chclause *clauses, int nclauses, int mode,
+      const int *weights, int64_t deadline) {
     if(dill_slow(nclauses < 0 || (nclauses && !clauses))) {
         errno = EINVAL; return -1;}
+    if(dill_slow(mode == DILL_CHOOSE_WEIGHTED && nclauses && !weights)) {
+        errno = EINVAL; return -1;}
     if(dill_slow(dill_running->canceled || dill_running->stopping)) {
         errno = ECANCELED; return -1;}
     /* Create unique ID for each invocation of choose(). It is used to
@@ -218,20 +680,52 @@ static int dill_choose_(struct chclause *clauses, int nclauses,
     struct dill_choosedata *cd = (struct dill_choosedata*)dill_running->opaque;
     cd->nclauses = nclauses;
     cd->clauses = cls;
+    cd->nfds = 0;
     cd->ddline = -1;
+    cd->since = -1;
     /* Find out which clauses are immediately available. */
     int available = 0;
     int i;
     for(i = 0; i != nclauses; ++i) {
+        if(dill_slow(weights && weights[i] < 0)) {errno = EINVAL; return -1;}
+        cls[i].cr = dill_running;
+        /* File descriptors are not polled until choose() blocks. */
+        if(dill_isfd(&cls[i])) {
+            if(dill_slow(cls[i].h < 0 ||
+                  (cls[i].len != 0 && cls[i].len != sizeof(int)) ||
+                  (cls[i].len > 0 && !cls[i].val))) {
+                errno = EINVAL;
+                return -1;
+            }
+            if(!cls[i].len)
+                cls[i].val = NULL;
+            cls[i].ch = NULL;
+            ++cd->nfds;
+            continue;
+        }
+        if(dill_slow(cls[i].op != CHSEND && cls[i].op != CHRECV &&
+              !dill_iswm(&cls[i]))) {
+            errno = EINVAL;
+            return -1;
+        }
         cls[i].ch = hdata(cls[i].h, dill_chan_type);
         if(dill_slow(!cls[i].ch)) return -1;
-        if(dill_slow(cls[i].ch->sz != cls[i].len ||
-              (cls[i].len > 0 && !cls[i].val) ||
-              (cls[i].op != CHSEND && cls[i].op != CHRECV))) {
+        /* Only the timer can send to a ticker. */
+        if(dill_slow(cls[i].op == CHSEND && cls[i].ch->ticker)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if(dill_slow(dill_iswm(&cls[i]))) {
+            /* Without watermarks the clause would never, respectively
+               always, fire. */
+            if(dill_slow(cls[i].len != 0 || !cls[i].ch->hwm)) {
+                errno = EINVAL; return -1;}
+        }
+        else if(dill_slow(cls[i].ch->sz != cls[i].len ||
+              (cls[i].len > 0 && !cls[i].val))) {
             errno = EINVAL;
             return -1;
         }
-        cls[i].cr = dill_running;
         struct dill_ep *ep = dill_getep(&cls[i]);
         if(ep->seq == seq)
             continue;
@@ -242,39 +736,74 @@ static int dill_choose_(struct chclause *clauses, int nclauses,
             ++available;
         }
     }
-    /* If there are clauses that are immediately available
-       randomly choose one of them. */
+    /* If there are clauses that are immediately available choose one of
+       them. */
     int res;
     if(available > 0) {
-        int chosen = available == 1 ? 0 : (int)(random() % available);
-        struct dill_clause *cl = &cls[cls[chosen].aidx];
+        res = dill_choose_pick(cls, available, mode, weights);
+        struct dill_clause *cl = &cls[res];
         if(cl->error == 0) {
-            if(cl->op == CHSEND)
-                dill_enqueue(cl->ch, cl->val);
-            else
+            if(cl->op == CHSEND) {
+                if(dill_slow(dill_enqueue(cl->ch, cl->val) < 0))
+                    return -1;
+            }
+            else if(cl->op == CHRECV)
                 dill_dequeue(cl->ch, cl->val);
         }
-        dill_resume(dill_running, dill_choose_index(cl));
+        /* Return straight away unless the coroutine has been running for
+           too long without letting others run. */
+        if(dill_fast(dill_spend())) goto finish;
+        dill_resume(dill_running, res);
         res = dill_suspend(NULL);
         goto finish;
     }
-    /* If non-blocking behaviour was requested, exit now. */
-    if(deadline == 0) {
-        dill_resume(dill_running, -1);
-        dill_suspend(NULL);
+    /* If non-blocking behaviour was requested, exit now. File descriptors,
+       if any, still have to be polled. */
+    if(deadline == 0 && !cd->nfds) {
+        if(dill_slow(!dill_spend())) {
+            dill_resume(dill_running, -1);
+            dill_suspend(NULL);
+        }
         errno = ETIMEDOUT;
         return -1;
     }
+    /* Start waiting for the file descriptors. */
+    if(cd->nfds) {
+        for(i = 0; i != nclauses; ++i) {
+            if(!dill_isfd(&cls[i]))
+                continue;
+            int rc = dill_fdwait_add(cls[i].h, dill_fdevents(&cls[i]));
+            if(dill_slow(rc < 0)) {
+                int err = errno;
+                while(i--) {
+                    if(dill_isfd(&cls[i]))
+                        dill_fdwait_rm(cls[i].h, dill_fdevents(&cls[i]));
+                }
+                errno = err;
+                return -1;
+            }
+        }
+        dill_running->fd_cb = dill_choose_fd_cb;
+    }
     /* If deadline was specified, start the timer. */
-    if(deadline > 0) {
+    deadline = dill_ddline(deadline);
+    if(deadline >= 0) {
         cd->ddline = deadline;
-        dill_timer_add(&dill_running->timer, deadline);
+        dill_timer_add_us(&dill_running->timer, deadline);
     }
+    if(dill_slow(dill_chstats_enabled))
+        cd->since = now();
     /* In all other cases register this coroutine with the queried channels
        and wait till one of the clauses unblocks. */
     for(i = 0; i != cd->nclauses; ++i) {
         struct dill_clause *cl = &cd->clauses[i];
+        if(dill_isfd(cl))
+            continue;
         dill_list_insert(&dill_getep(cl)->clauses, &cl->epitem, NULL);
+        if(dill_slow(dill_iswm(cl)))
+            continue;
+        /* The peers may be able to proceed now. */
+        dill_ep_notify(cl->op == CHSEND ? &cl->ch->receiver : &cl->ch->sender);
     }
     /* If there are multiple parallel chooses done from different coroutines
        all but one must be blocked on the following line. */
@@ -283,34 +812,94 @@ finish:
     /* Global error, not related to any particular clause. */
     if(dill_slow(res < 0)) {errno = -res; return -1;}
     /* Success or error for the triggered clause. */
-    if(dill_slow(cls[res].error != 0)) {errno = cls[res].error; return -1;}
-
+    errno = cls[res].error;
     return res;
 }
 
 int dill_choose(struct chclause *clauses, int nclauses, int64_t deadline,
       const char *current) {
-    return dill_choose_(clauses, nclauses, deadline);
+    return dill_choose_(clauses, nclauses, DILL_CHOOSE_UNIFORM, NULL,
+        dill_ms2us(deadline));
 }
 
-int dill_chsend(int ch, const void *val, size_t len, int64_t deadline,
+int dill_choose_us(struct chclause *clauses, int nclauses, int64_t deadline,
+      const char *current) {
+    return dill_choose_(clauses, nclauses, DILL_CHOOSE_UNIFORM, NULL,
+        deadline);
+}
+
+int dill_choosefirst(struct chclause *clauses, int nclauses, int64_t deadline,
+      const char *current) {
+    return dill_choose_(clauses, nclauses, DILL_CHOOSE_FIRST, NULL,
+        dill_ms2us(deadline));
+}
+
+int dill_chooseweighted(struct chclause *clauses, int nclauses,
+      const int *weights, int64_t deadline, const char *current) {
+    return dill_choose_(clauses, nclauses, DILL_CHOOSE_WEIGHTED, weights,
+        dill_ms2us(deadline));
+}
+
+/* Returns 1 if a single send or receive on the channel can complete
+   immediately, without blocking and without yielding. */
+static int dill_chan_ready(struct dill_chan *ch, int op, const void *val,
+      size_t len) {
+    if(dill_slow(!ch || len != ch->sz || (len > 0 && !val))) return 0;
+    if(dill_slow(dill_running->canceled || dill_running->stopping)) return 0;
+    if(op == CHSEND) {
+        if(dill_slow(ch->done || ch->ticker)) return 0;
+        if(ch->items == ch->bufsz && !ch->policy &&
+              !dill_ep_peer(&ch->receiver)) return 0;
+    }
+    else {
+        if(!ch->items && !dill_ep_peer(&ch->sender)) return 0;
+    }
+    return dill_spend();
+}
+
+int dill_chsend_us(int ch, const void *val, size_t len, int64_t deadline,
       const char *current) {
-    struct chclause cl = {ch, CHSEND, (void*)val, len};
-    int res = dill_choose_(&cl, 1, deadline);
+    /* Skip the pollset machinery if the message can be sent right away. */
+    struct dill_chan *c = hdata(ch, dill_chan_type);
+    if(dill_fast(dill_chan_ready(c, CHSEND, val, len)))
+        return dill_enqueue(c, (void*)val);
+    struct chclause cl = {.h = ch, .op = CHSEND, .val = (void*)val,
+        .len = len};
+    int res = dill_choose_(&cl, 1, DILL_CHOOSE_UNIFORM, NULL, deadline);
     if(dill_slow(res == 0 && errno != 0))
         res = -1;
+    /* The handle may be a channel shared with other processes. */
+    if(dill_slow(res < 0 && errno == ENOTSUP))
+        return dill_shchan_send(ch, val, len, dill_us2ms(deadline));
     return res;
 }
 
-int dill_chrecv(int ch, void *val, size_t len, int64_t deadline,
+int dill_chsend(int ch, const void *val, size_t len, int64_t deadline,
+      const char *current) {
+    return dill_chsend_us(ch, val, len, dill_ms2us(deadline), current);
+}
+
+int dill_chrecv_us(int ch, void *val, size_t len, int64_t deadline,
       const char *current) {
-    struct chclause cl = {ch, CHRECV, val, len};
-    int res = dill_choose_(&cl, 1, deadline);
+    struct dill_chan *c = hdata(ch, dill_chan_type);
+    if(dill_fast(dill_chan_ready(c, CHRECV, val, len))) {
+        dill_dequeue(c, val);
+        return 0;
+    }
+    struct chclause cl = {.h = ch, .op = CHRECV, .val = val, .len = len};
+    int res = dill_choose_(&cl, 1, DILL_CHOOSE_UNIFORM, NULL, deadline);
     if(dill_slow(res == 0 && errno != 0))
         res = -1;
+    if(dill_slow(res < 0 && errno == ENOTSUP))
+        return dill_shchan_recv(ch, val, len, dill_us2ms(deadline));
     return res;
 }
 
+int dill_chrecv(int ch, void *val, size_t len, int64_t deadline,
+      const char *current) {
+    return dill_chrecv_us(ch, val, len, dill_ms2us(deadline), current);
+}
+
 int dill_chdone(int h, const char *current) {
     struct dill_chan *ch = hdata(h, dill_chan_type);
     if(dill_slow(!ch)) return -1;
@@ -318,19 +907,317 @@ int dill_chdone(int h, const char *current) {
     /* Put the channel into done-with mode. */
     ch->done = 1;
     /* Resume any remaining senders on the channel. */
-    while(!dill_list_empty(&ch->sender.clauses)) {
-        struct dill_clause *cl = dill_cont(dill_list_begin(&ch->sender.clauses),
-            struct dill_clause, epitem);
-        cl->error = EPIPE;
-        dill_resume(cl->cr, dill_choose_index(cl));
-    }
+    struct dill_clause *cl;
+    while((cl = dill_ep_peer(&ch->sender)))
+        dill_trigger(cl, EPIPE);
     /* Resume all the receivers currently waiting on the channel. */
-    while(!dill_list_empty(&ch->receiver.clauses)) {
-        struct dill_clause *cl = dill_cont(
-            dill_list_begin(&ch->receiver.clauses), struct dill_clause, epitem);
-        cl->error = EPIPE;
-        dill_resume(cl->cr, dill_choose_index(cl));
+    while((cl = dill_ep_peer(&ch->receiver)))
+        dill_trigger(cl, EPIPE);
+    /* No more messages will be sent so the watermarks won't be crossed. */
+    while((cl = dill_ep_peer(&ch->high)))
+        dill_trigger(cl, EPIPE);
+    while((cl = dill_ep_peer(&ch->low)))
+        dill_trigger(cl, EPIPE);
+    dill_ep_notify(&ch->sender);
+    dill_ep_notify(&ch->receiver);
+    return 0;
+}
+
+
+static void dill_selclause_link(struct dill_selclause *scl) {
+    if(!dill_list_item_inlist(&scl->linkitem))
+        dill_list_insert(&scl->sel->linked, &scl->linkitem, NULL);
+}
+
+int dill_chwatermarks(int h, size_t high, size_t low, const char *current) {
+    struct dill_chan *ch = hdata(h, dill_chan_type);
+    if(dill_slow(!ch)) return -1;
+    if(dill_slow(high && (low >= high || high > ch->bufsz))) {
+        errno = EINVAL; return -1;}
+    ch->hwm = high;
+    ch->lwm = low;
+    /* Apply the new thresholds to the messages already in the channel. */
+    if(!ch->congested && high && ch->items >= high)
+        dill_chan_congest(ch, 1);
+    else if(ch->congested && (!high || ch->items <= low))
+        dill_chan_congest(ch, 0);
+    /* Watermark clauses can't be used without watermarks. */
+    if(!high) {
+        struct dill_clause *cl;
+        while((cl = dill_ep_peer(&ch->high)))
+            dill_trigger(cl, EINVAL);
+    }
+    return 0;
+}
+
+/* Passes the number of ticks since the last one was received to the ticker
+   channel and re-arms the timer. If the previous ticks weren't received yet,
+   the number is added to them rather than queued. */
+static int dill_ticker_fire(struct dill_timer *timer) {
+    struct dill_ticker *tk = dill_cont(timer, struct dill_ticker, timer);
+    struct dill_chan *ch = tk->ch;
+    if(dill_slow(ch->done))
+        return 0;
+    /* If the process was busy for more than a period, skip the missed ticks
+       instead of firing the timer for each of them. */
+    uint64_t ticks = 1;
+    int64_t nw = now_us();
+    if(dill_slow(nw - timer->expiry >= tk->period))
+        ticks += (nw - timer->expiry) / tk->period;
+    dill_timer_add_us(timer, timer->expiry + ticks * tk->period);
+    if(ch->items) {
+        uint64_t *pending = (uint64_t*)(((char*)(ch + 1)) +
+            (ch->first * ch->sz));
+        *pending += ticks;
+        return 0;
+    }
+    int resumed = dill_ep_peer(&ch->receiver) ? 1 : 0;
+    int rc = dill_enqueue(ch, &ticks);
+    dill_assert(rc == 0);
+    return resumed;
+}
+
+int dill_ticker_us(int64_t period, const char *created) {
+    dill_preserve_debug();
+    if(dill_slow(period <= 0)) {errno = EINVAL; return -1;}
+    struct dill_ticker *tk = malloc(sizeof(struct dill_ticker));
+    if(dill_slow(!tk)) {errno = ENOMEM; return -1;}
+    struct dill_chan *ch = dill_chan_alloc(sizeof(uint64_t), 1, 0);
+    if(dill_slow(!ch)) {free(tk); return -1;}
+    int h = dill_chan_handle(ch, created);
+    if(dill_slow(h < 0)) {free(tk); return -1;}
+    tk->ch = ch;
+    tk->period = period;
+    ch->ticker = tk;
+    dill_timer_init(&tk->timer, dill_ticker_fire);
+    dill_timer_add_us(&tk->timer, now_us() + period);
+    return h;
+}
+
+int dill_ticker(int64_t period, const char *created) {
+    if(dill_slow(period <= 0 || period > INT64_MAX / 1000)) {
+        errno = EINVAL; return -1;}
+    return dill_ticker_us(period * 1000, created);
+}
+
+int dill_chpolicy(int h, int policy, const char *current) {
+    struct dill_chan *ch = hdata(h, dill_chan_type);
+    if(dill_slow(!ch)) return -1;
+    if(dill_slow(policy != CHBLOCK && policy != CHOVERWRITE &&
+          policy != CHDROP)) {
+        errno = EINVAL; return -1;}
+    /* Only fixed-size ring buffers can drop messages. */
+    if(dill_slow(policy != CHBLOCK && (ch->segitems || !ch->bufsz))) {
+        errno = EINVAL; return -1;}
+    ch->policy = policy;
+    /* Senders blocked on a full buffer can proceed now. */
+    if(policy != CHBLOCK) {
+        struct dill_clause *cl;
+        while((cl = dill_ep_peer(&ch->sender))) {
+            if(dill_slow(dill_enqueue(ch, cl->val) < 0)) return -1;
+            dill_trigger(cl, 0);
+        }
     }
     return 0;
 }
 
+int dill_chselector(struct chclause *clauses, int nclauses,
+      const char *created) {
+    if(dill_slow(nclauses < 0 || (nclauses && !clauses))) {
+        errno = EINVAL; return -1;}
+    dill_preserve_debug();
+    /* Allocate the selector followed by the clauses and the array used to
+       choose among the available clauses. */
+    struct dill_selector *sel = (struct dill_selector*)malloc(
+        sizeof(struct dill_selector) +
+        nclauses * (sizeof(struct dill_selclause) + sizeof(int)));
+    if(dill_slow(!sel)) {errno = ENOMEM; return -1;}
+    sel->nclauses = nclauses;
+    sel->clauses = (struct dill_selclause*)(sel + 1);
+    sel->available = (int*)(sel->clauses + nclauses);
+    dill_list_init(&sel->ready);
+    dill_list_init(&sel->linked);
+    sel->cr = NULL;
+    /* Validate all the clauses before registering any of them. */
+    int i;
+    for(i = 0; i != nclauses; ++i) {
+        struct dill_chan *ch = hdata(clauses[i].h, dill_chan_type);
+        if(dill_slow(!ch)) {int err = errno; free(sel); errno = err; return -1;}
+        if(dill_slow(ch->sz != clauses[i].len ||
+              (clauses[i].len > 0 && !clauses[i].val) ||
+              (clauses[i].op != CHSEND && clauses[i].op != CHRECV))) {
+            free(sel);
+            errno = EINVAL;
+            return -1;
+        }
+        struct dill_selclause *scl = &sel->clauses[i];
+        scl->cl.h = clauses[i].h;
+        scl->cl.op = clauses[i].op;
+        scl->cl.val = clauses[i].val;
+        scl->cl.len = clauses[i].len;
+        scl->cl.ch = ch;
+        scl->cl.cr = NULL;
+        scl->cl.error = 0;
+        scl->sel = sel;
+        dill_list_item_init(&scl->watchitem);
+        dill_list_item_init(&scl->readyitem);
+        dill_list_item_init(&scl->linkitem);
+    }
+    int h = dill_handle(dill_selector_type, sel, &dill_selector_vfptrs,
+        created);
+    if(dill_slow(h < 0)) {
+        int err = errno;
+        free(sel);
+        errno = err;
+        return -1;
+    }
+    for(i = 0; i != nclauses; ++i) {
+        struct dill_selclause *scl = &sel->clauses[i];
+        struct dill_chan *ch = scl->cl.ch;
+        /* If another selector watches the other side of the channel the two
+           may have to meet without either of them being blocked on the
+           endpoint. Mark the clauses on both sides so that they are always
+           checked. */
+        struct dill_ep *peer = scl->cl.op == CHSEND ?
+            &ch->receiver : &ch->sender;
+        struct dill_list_item *it;
+        for(it = dill_list_begin(&peer->watchers); it;
+              it = dill_list_next(it)) {
+            dill_selclause_link(dill_cont(it, struct dill_selclause,
+                watchitem));
+            dill_selclause_link(scl);
+        }
+        dill_list_insert(&dill_getep(&scl->cl)->watchers, &scl->watchitem,
+            NULL);
+        /* We don't know the state of the channel yet. */
+        dill_list_insert(&sel->ready, &scl->readyitem, NULL);
+    }
+    return h;
+}
+
+static void dill_select_unblock_cb(struct dill_cr *cr) {
+    struct dill_selectdata *sd = (struct dill_selectdata*)cr->opaque;
+    int64_t blocked = dill_slow(sd->since >= 0) ? now() - sd->since : -1;
+    int i;
+    for(i = 0; i != sd->sel->nclauses; ++i) {
+        struct dill_clause *cl = &sd->sel->clauses[i].cl;
+        if(!cl->ch)
+            continue;
+        --dill_getep(cl)->blocked;
+        if(dill_slow(blocked >= 0))
+            dill_chan_blocked(cl, blocked);
+    }
+    sd->sel->cr = NULL;
+    if(sd->ddline > 0)
+        dill_timer_rm(&cr->timer);
+}
+
+int dill_chselect(int h, int64_t deadline, const char *current) {
+    struct dill_selector *sel = hdata(h, dill_selector_type);
+    if(dill_slow(!sel)) return -1;
+    if(dill_slow(dill_running->canceled || dill_running->stopping)) {
+        errno = ECANCELED; return -1;}
+    /* Only one coroutine can wait for a selector at a time. */
+    if(dill_slow(sel->cr)) {errno = EBUSY; return -1;}
+    /* Linked clauses are checked on every wait. See dill_chselector(). */
+    struct dill_list_item *it;
+    for(it = dill_list_begin(&sel->linked); it; it = dill_list_next(it)) {
+        struct dill_selclause *scl = dill_cont(it, struct dill_selclause,
+            linkitem);
+        if(!dill_list_item_inlist(&scl->readyitem))
+            dill_list_insert(&sel->ready, &scl->readyitem, NULL);
+    }
+    /* Find out which of the candidate clauses are immediately available.
+       Drop those that would block from the list. */
+    int available = 0;
+    it = dill_list_begin(&sel->ready);
+    while(it) {
+        struct dill_selclause *scl = dill_cont(it, struct dill_selclause,
+            readyitem);
+        /* The channel was already closed. */
+        if(dill_slow(!scl->cl.ch))
+            scl->cl.error = EPIPE;
+        else
+            scl->cl.error = dill_choose_error(&scl->cl);
+        if(scl->cl.error == EAGAIN) {
+            dill_getep(&scl->cl)->unready = 1;
+            it = dill_list_erase(&sel->ready, it);
+            continue;
+        }
+        sel->available[available] = scl - sel->clauses;
+        ++available;
+        it = dill_list_next(it);
+    }
+    /* If there are clauses that are immediately available
+       randomly choose one of them. */
+    int res;
+    if(available > 0) {
+        res = sel->available[available == 1 ? 0 : dill_rand(available)];
+        struct dill_clause *cl = &sel->clauses[res].cl;
+        if(cl->error == 0) {
+            if(cl->op == CHSEND) {
+                if(dill_slow(dill_enqueue(cl->ch, cl->val) < 0))
+                    return -1;
+            }
+            else
+                dill_dequeue(cl->ch, cl->val);
+        }
+        if(dill_fast(dill_spend())) goto finish;
+        dill_resume(dill_running, res);
+        res = dill_suspend(NULL);
+        goto finish;
+    }
+    /* If non-blocking behaviour was requested, exit now. */
+    if(deadline == 0) {
+        if(dill_slow(!dill_spend())) {
+            dill_resume(dill_running, -1);
+            dill_suspend(NULL);
+        }
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    struct dill_selectdata *sd = (struct dill_selectdata*)dill_running->opaque;
+    sd->sel = sel;
+    sd->ddline = -1;
+    sd->since = dill_slow(dill_chstats_enabled) ? now() : -1;
+    deadline = dill_ddline(dill_ms2us(deadline));
+    if(deadline >= 0) {
+        sd->ddline = deadline;
+        dill_timer_add_us(&dill_running->timer, deadline);
+    }
+    /* The clauses are already registered with the channels. Marking the
+       selector as blocked is all that's needed. */
+    sel->cr = dill_running;
+    int i;
+    for(i = 0; i != sel->nclauses; ++i) {
+        struct dill_clause *cl = &sel->clauses[i].cl;
+        if(cl->ch)
+            ++dill_getep(cl)->blocked;
+    }
+    res = dill_suspend(dill_select_unblock_cb);
+finish:
+    if(dill_slow(res < 0)) {errno = -res; return -1;}
+    errno = sel->clauses[res].cl.error;
+    return res;
+}
+
+static void dill_selector_close(int h) {
+    struct dill_selector *sel = hdata(h, dill_selector_type);
+    dill_assert(sel);
+    if(sel->cr)
+        dill_resume(sel->cr, -EBADF);
+    int i;
+    for(i = 0; i != sel->nclauses; ++i) {
+        struct dill_selclause *scl = &sel->clauses[i];
+        if(scl->cl.ch)
+            dill_list_erase(&dill_getep(&scl->cl)->watchers, &scl->watchitem);
+    }
+    free(sel);
+}
+
+static void dill_selector_dump(int h) {
+    struct dill_selector *sel = hdata(h, dill_selector_type);
+    dill_assert(sel);
+    fprintf(stderr, "  SELECTOR clauses:%d waiting:%d\n",
+        sel->nclauses, sel->cr ? 1 : 0);
+}
@@ -27,17 +27,33 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "debug.h"
 #include "list.h"
+#include "slist.h"
+#include "timer.h"
 
 /* Per-coroutine data. Used to store info while choose() is blocked. */
 struct dill_choosedata {
     /* Pollset, ase passed to the choose() function. */
     int nclauses;
     struct dill_clause *clauses;
+    /* Number of file descriptor clauses in the pollset. */
+    int nfds;
     /* Deadline specified in 'deadline' clause. -1 if none. */
     int64_t ddline;
+    /* When choose() blocked. Set only if statistics are being collected. */
+    int64_t since;
+};
+
+/* Per-coroutine data. Used to store info while chselect() is blocked. */
+struct dill_selectdata {
+    struct dill_selector *sel;
+    /* Deadline passed to chselect(). -1 if none. */
+    int64_t ddline;
+    /* When chselect() blocked. Set only if statistics are being collected. */
+    int64_t since;
 };
 
 /* Channel endpoint. */
@@ -48,9 +64,31 @@ struct dill_ep {
     uint64_t seq;
     /* List of clauses waiting for this endpoint. */
     struct dill_list clauses;
+    /* List of selector clauses registered with this endpoint. Unlike the
+       clauses above they stay here even when the selector is not waiting. */
+    struct dill_list watchers;
+    /* Number of the watchers whose selector has a coroutine waiting. */
+    int blocked;
+    /* Set if some of the watchers may not be on their selector's list of
+       ready clauses. If not set, there's no need to notify them. */
+    int unready;
+};
+
+/* A chunk of the message buffer of an unbounded channel. The messages
+   directly follow this structure. */
+struct dill_chseg {
+    struct dill_slist_item item;
 };
 
 /* Channel. */
+/* Timer feeding ticks into a channel created by ticker(). */
+struct dill_ticker {
+    struct dill_timer timer;
+    struct dill_chan *ch;
+    /* Period in microseconds. */
+    int64_t period;
+};
+
 struct dill_chan {
     /* The size of the elements stored in the channel, in bytes. */
     size_t sz;
@@ -58,6 +96,9 @@ struct dill_chan {
        of clauses waiting to receive. */
     struct dill_ep sender;
     struct dill_ep receiver;
+    /* Clauses waiting for the channel to get congested or relieved. */
+    struct dill_ep high;
+    struct dill_ep low;
     /* 1 is chdone() was already called. 0 otherwise. */
     int done;
 
@@ -69,8 +110,50 @@ struct dill_chan {
     size_t bufsz;
     size_t items;
     size_t first;
+
+    /* If 'segitems' is non-zero the channel is unbounded. There's no buffer
+       following the chan structure. Instead, messages are stored in a queue
+       of segments, each holding 'segitems' messages. 'first' is the index of
+       the next message in the first segment, 'last' is the index of the next
+       free slot in the last segment. 'bufsz' is the soft limit: senders block
+       once there are that many messages in the channel. */
+    size_t segitems;
+    size_t last;
+    struct dill_slist segs;
+
+    /* Watermarks. The channel becomes congested when the number of messages
+       in the buffer reaches 'hwm' and stops being congested when it drops
+       to 'lwm'. 'hwm' is zero if watermarks are not used. */
+    size_t hwm;
+    size_t lwm;
+    int congested;
+    /* What to do when sending to a full buffer. One of CHBLOCK, CHOVERWRITE
+       or CHDROP. */
+    int policy;
+    /* Number of messages lost because of the overflow policy. */
+    uint64_t dropped;
+    /* Set if the channel is a ticker. */
+    struct dill_ticker *ticker;
+
+    /* Statistics. Allocated when the channel is first used while statistics
+       are being collected. NULL otherwise. */
+    struct chstats *stats;
 };
 
+/* Copies a message. Messages of the sizes typical for file descriptors,
+   integers and pointers are copied using fixed-size moves instead of
+   calling memcpy() with variable size. */
+static inline void dill_chan_copy(void *dst, const void *src, size_t sz) {
+    switch(sz) {
+    case 1: memcpy(dst, src, 1); return;
+    case 2: memcpy(dst, src, 2); return;
+    case 4: memcpy(dst, src, 4); return;
+    case 8: memcpy(dst, src, 8); return;
+    case 16: memcpy(dst, src, 16); return;
+    default: memcpy(dst, src, sz);
+    }
+}
+
 /* This structure represents a single clause in a choose statement.
    Similarly, both chs() and chr() each create a single clause. */
 struct dill_clause {
@@ -79,11 +162,12 @@ struct dill_clause {
     int op;
     void *val;
     size_t len;
-    /* Pointer to the channel, retrieved from the handle. */
+    /* Pointer to the channel, retrieved from the handle. NULL for file
+       descriptor clauses. */
     struct dill_chan *ch;
     /* Member of list of clauses waiting for a channel endpoint. */
     struct dill_list_item epitem;
-    /* The coroutine which created the clause. */
+    /* The coroutine which created the clause. NULL for selector clauses. */
     struct dill_cr *cr;
     /* Error that would be returned by this operation. */
     int error;
@@ -92,5 +176,42 @@ struct dill_clause {
     int aidx;
 };
 
-#endif
+/* A clause of a selector. The underlying clause is not inserted into the
+   endpoint's list of waiting clauses. Instead, the selector clause is
+   permanently registered as a watcher of the endpoint. */
+struct dill_selclause {
+    struct dill_clause cl;
+    /* The selector this clause belongs to. */
+    struct dill_selector *sel;
+    /* Member of the list of watchers of the endpoint. */
+    struct dill_list_item watchitem;
+    /* Member of selector's list of clauses that may be available. */
+    struct dill_list_item readyitem;
+    /* Member of selector's list of linked clauses. */
+    struct dill_list_item linkitem;
+};
 
+/* Selector is a persistent pollset. The clauses are registered with the
+   channels once, when the selector is created, and the channels report
+   the changes of their state back to the selector. Therefore, waiting for
+   the selector doesn't require walking all the clauses. */
+struct dill_selector {
+    /* The clauses directly follow the selector structure. They are followed
+       by an array of 'nclauses' ints used to choose among the available
+       clauses. */
+    int nclauses;
+    struct dill_selclause *clauses;
+    int *available;
+    /* Clauses which may be immediately available. A clause is added to this
+       list when the state of the channel changes and removed lazily when
+       it turns out it would block. */
+    struct dill_list ready;
+    /* Clauses whose peer may be another selector. A blocked selector doesn't
+       report that it's waiting, so these clauses are rechecked on each
+       wait. */
+    struct dill_list linked;
+    /* Coroutine waiting in chselect(). NULL if there's none. */
+    struct dill_cr *cr;
+};
+
+#endif
@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #if defined DILL_VALGRIND
 #include <valgrind/valgrind.h>
@@ -49,37 +50,71 @@ static const struct hvfptrs dill_cr_vfptrs = {
     dill_cr_dump
 };
 
+static const int dill_group_type_placeholder = 0;
+static const void *dill_group_type = &dill_group_type_placeholder;
+
+static void dill_group_close(int h);
+static void dill_group_dump(int h);
+
+static const struct hvfptrs dill_group_vfptrs = {
+    dill_group_close,
+    dill_group_dump
+};
+
+/* A set of coroutines which are cancelled and waited for together. */
+struct dill_group {
+    /* Coroutines in the group that haven't finished yet. */
+    struct dill_list members;
+    int nmembers;
+    /* Coroutine waiting for all the members to finish. */
+    struct dill_cr *waiter;
+};
+
+/* Per-coroutine data. Used to store info while groupwait() is blocked. */
+struct dill_groupdata {
+    struct dill_group *group;
+    int64_t ddline;
+};
+
+DILL_CT_ASSERT(sizeof(struct dill_groupdata) <= DILL_OPAQUE_SIZE);
+
 volatile int dill_unoptimisable1 = 1;
 volatile void *dill_unoptimisable2 = NULL;
 
-struct dill_cr dill_main = {DILL_SLIST_ITEM_INITIALISER};
+struct dill_cr dill_main = {.ready = DILL_SLIST_ITEM_INITIALISER, .ddline = -1};
 
 struct dill_cr *dill_running = &dill_main;
 
+int dill_budget = DILL_BUDGET;
+
+uint64_t dill_rand_state = 0x9e3779b97f4a7c15ULL;
+
 /* Queue of coroutines scheduled for execution. */
 static struct dill_slist dill_ready = {0};
 
 int dill_suspend(dill_unblock_cb unblock_cb) {
+    static int counter = 0;
+    /* Store the context of the current coroutine, if any. This has to be
+       done before polling below as the coroutine may be resumed there. */
+    if(dill_running) {
+        dill_running->unblock_cb = unblock_cb;
+        if(sigsetjmp(dill_running->ctx,0))
+            return dill_running->sresult;
+    }
     /* Even if process never gets idle, we have to process external events
        once in a while. The external signal may very well be a deadline or
        a user-issued command that cancels the CPU intensive operation. */
-    static int counter = 0;
     if(counter >= 103) {
         dill_wait(0);
         counter = 0;
     }
-    /* Store the context of the current coroutine, if any. */
-    if(dill_running) {
-        dill_running->unblock_cb = unblock_cb;
-        if(sigsetjmp(dill_running->ctx,0))
-            return dill_running->sresult;
-    }
     while(1) {
         /* If there's a coroutine ready to be executed go for it. */
         if(!dill_slist_empty(&dill_ready)) {
             ++counter;
             struct dill_slist_item *it = dill_slist_pop(&dill_ready);
             dill_running = dill_cont(it, struct dill_cr, ready);
+            dill_budget = DILL_BUDGET;
             siglongjmp(dill_running->ctx, 1);
         }
         /* Otherwise, we are going to wait for sleeping coroutines
@@ -90,6 +125,25 @@ int dill_suspend(dill_unblock_cb unblock_cb) {
     }
 }
 
+int dill_transfer(struct dill_cr *cr, int result,
+      dill_unblock_cb unblock_cb) {
+    if(dill_slow(!dill_spend())) {
+        dill_resume(cr, result);
+        return dill_suspend(unblock_cb);
+    }
+    dill_assert(!dill_slist_item_inlist(&cr->ready));
+    if(cr->unblock_cb) {
+        cr->unblock_cb(cr);
+        cr->unblock_cb = NULL;
+    }
+    cr->sresult = result;
+    dill_running->unblock_cb = unblock_cb;
+    if(sigsetjmp(dill_running->ctx, 0))
+        return dill_running->sresult;
+    dill_running = cr;
+    siglongjmp(cr->ctx, 1);
+}
+
 void dill_resume(struct dill_cr *cr, int result) {
     dill_assert(!dill_slist_item_inlist(&cr->ready));
     if(cr->unblock_cb) {
@@ -100,6 +154,18 @@ void dill_resume(struct dill_cr *cr, int result) {
     dill_slist_push_back(&dill_ready, &cr->ready);
 }
 
+/* Removes a finished coroutine from its group. */
+static void dill_group_leave(struct dill_cr *cr) {
+    struct dill_group *grp = cr->group;
+    dill_list_erase(&grp->members, &cr->groupitem);
+    --grp->nmembers;
+    cr->group = NULL;
+    int rc = hclose(cr->hndl);
+    dill_assert(rc == 0);
+    if(!grp->nmembers && grp->waiter)
+        dill_resume(grp->waiter, 0);
+}
+
 /* dill_prologue() and dill_epilogue() live in the same scope with
    libdill's stack-switching black magic. As such, they are extremely
    fragile. Therefore, the optimiser is prohibited to touch them. */
@@ -127,12 +193,20 @@ int dill_prologue(sigjmp_buf **ctx, const char *created) {
     cr->canceled = 0;
     cr->stopping = 0;
     cr->waiter = NULL;
+    cr->result = 0;
+    cr->consumer = NULL;
+    cr->genparked = 0;
+    cr->group = NULL;
     cr->cls = NULL;
     cr->unblock_cb = NULL;
+    cr->fd_cb = NULL;
+    dill_timer_init(&cr->timer, NULL);
 #if defined DILL_VALGRIND
     cr->sid = VALGRIND_STACK_REGISTER((char*)(cr + 1) - stack_size, cr);
 #endif
     /* Suspend the parent coroutine and make the new one running. */
+    cr->slack = dill_running->slack;
+    cr->ddline = dill_running->ddline;
     *ctx = &dill_running->ctx;
     dill_resume(dill_running, 0);    
     dill_running = cr;
@@ -143,13 +217,21 @@ int dill_prologue(sigjmp_buf **ctx, const char *created) {
 __attribute__((noinline)) dill_noopt void dill_epilogue(void) {
     /* Result is stored in the handle so that it is available even after
        the stack is deallocated. */
-    dill_handle_done(dill_running->hndl);
-    /* Resume a coroutine stuck in hclose(). */
+    dill_handle_done(dill_running->hndl, dill_running->result);
+    /* Group members are owned by the group. */
+    if(dill_running->group)
+        dill_group_leave(dill_running);
+    /* There will be no more values for the consumer. */
+    if(dill_running->consumer)
+        dill_resume(dill_running->consumer, -EPIPE);
+    /* Resume a coroutine stuck in hclose() or cojoin(). */
     if(dill_running->waiter)
-        dill_resume(dill_running->waiter, 0);
+        dill_resume(dill_running->waiter, dill_running->waitidx);
 #if defined DILL_VALGRIND
     VALGRIND_STACK_DEREGISTER(dill_running->sid);
 #endif
+    /* The timer may still be linked to the wheel even if it was removed. */
+    dill_timer_purge(&dill_running->timer);
     /* Deallocate. */
     dill_freestack(dill_running + 1);
     dill_running = NULL;
@@ -162,12 +244,17 @@ static void dill_cr_close(int h) {
     struct dill_cr *cr = (struct dill_cr*)hdata(h, dill_cr_type);
     /* If the coroutine have already finished, we are done. */
     if(!cr) return;
+    /* If somebody is joining the coroutine, the handle is gone under
+       its hands. */
+    if(cr->waiter)
+        dill_resume(cr->waiter, -EBADF);
     /* Ask coroutine to cancel. */
     cr->canceled = 1;
     if(!dill_slist_item_inlist(&cr->ready))
         dill_resume(cr, -ECANCELED);
     /* Wait till it finishes cancelling. */
     cr->waiter = dill_running;
+    cr->waitidx = 0;
     int rc = dill_suspend(NULL);
     dill_assert(rc == 0);
     cr->waiter = NULL;
@@ -182,6 +269,271 @@ static void dill_cr_dump(int h) {
     fprintf(stderr, "  COROUTINE state:running\n");
 }
 
+void dill_setresult(intptr_t result) {
+    dill_running->result = result;
+}
+
+/* Per-coroutine data. Used to store info while cojoin() is blocked. */
+struct dill_joindata {
+    int *hndls;
+    int nhndls;
+    int64_t ddline;
+};
+
+DILL_CT_ASSERT(sizeof(struct dill_joindata) <= DILL_OPAQUE_SIZE);
+
+static void dill_join_unblock_cb(struct dill_cr *cr) {
+    struct dill_joindata *jd = (struct dill_joindata*)cr->opaque;
+    int err = errno;
+    int i;
+    for(i = 0; i != jd->nhndls; ++i) {
+        /* The coroutine that has just finished returns NULL here. */
+        struct dill_cr *c = hdata(jd->hndls[i], dill_cr_type);
+        if(c && c->waiter == cr)
+            c->waiter = NULL;
+    }
+    errno = err;
+    if(jd->ddline >= 0)
+        dill_timer_rm(&cr->timer);
+}
+
+static int dill_join(int *hndls, int nhndls, intptr_t *result,
+      int64_t deadline) {
+    if(dill_slow(nhndls <= 0 || !hndls)) {errno = EINVAL; return -1;}
+    /* If any of the coroutines has already finished, we are done. */
+    int i;
+    for(i = 0; i != nhndls; ++i) {
+        errno = 0;
+        struct dill_cr *cr = hdata(hndls[i], dill_cr_type);
+        if(!cr) {
+            if(dill_slow(errno)) return -1;
+            goto finished;
+        }
+        if(dill_slow(cr == dill_running)) {errno = EDEADLK; return -1;}
+        if(dill_slow(cr->waiter || cr->group)) {errno = EBUSY; return -1;}
+    }
+    if(dill_slow(dill_running->canceled || dill_running->stopping)) {
+        errno = ECANCELED; return -1;}
+    if(dill_slow(deadline == 0)) {errno = ETIMEDOUT; return -1;}
+    for(i = 0; i != nhndls; ++i) {
+        struct dill_cr *cr = hdata(hndls[i], dill_cr_type);
+        cr->waiter = dill_running;
+        cr->waitidx = i;
+    }
+    struct dill_joindata *jd = (struct dill_joindata*)dill_running->opaque;
+    jd->hndls = hndls;
+    jd->nhndls = nhndls;
+    deadline = dill_ddline(dill_ms2us(deadline));
+    jd->ddline = deadline;
+    if(deadline >= 0)
+        dill_timer_add_us(&dill_running->timer, deadline);
+    i = dill_suspend(dill_join_unblock_cb);
+    if(dill_slow(i < 0)) {errno = -i; return -1;}
+finished:
+    if(result)
+        *result = dill_handle_result(hndls[i]);
+    int rc = hclose(hndls[i]);
+    dill_assert(rc == 0);
+    return i;
+}
+
+int dill_cojoin(int h, intptr_t *result, int64_t deadline,
+      const char *current) {
+    int rc = dill_join(&h, 1, result, deadline);
+    return rc < 0 ? -1 : 0;
+}
+
+int dill_cojoinany(int *hndls, int nhndls, intptr_t *result,
+      int64_t deadline, const char *current) {
+    return dill_join(hndls, nhndls, result, deadline);
+}
+
+int dill_genyield(const void *val, size_t len, const char *current) {
+    struct dill_cr *self = dill_running;
+    while(1) {
+        if(dill_slow(self->canceled || self->stopping)) {
+            errno = ECANCELED; return -1;}
+        if(dill_slow(len > 0 && !val)) {errno = EINVAL; return -1;}
+        struct dill_cr *consumer = self->consumer;
+        int rc;
+        /* The consumer asked for a value of a different size. */
+        if(dill_slow(consumer && len != self->genlen)) {
+            dill_resume(consumer, -EINVAL);
+            consumer = NULL;
+        }
+        if(consumer) {
+            memcpy(self->genval, val, len);
+            /* Pass control directly to the consumer and wait till it asks
+               for the next value. */
+            self->genparked = 1;
+            rc = dill_transfer(consumer, 0, NULL);
+            self->genparked = 0;
+            if(dill_slow(rc < 0)) {errno = -rc; return -1;}
+            return 0;
+        }
+        /* Nobody is asking for the value yet. */
+        self->genparked = 1;
+        rc = dill_suspend(NULL);
+        self->genparked = 0;
+        if(dill_slow(rc < 0)) {errno = -rc; return -1;}
+    }
+}
+
+/* Per-coroutine data. Used to store info while gennext() is blocked. */
+struct dill_gendata {
+    struct dill_cr *producer;
+    int64_t ddline;
+};
+
+DILL_CT_ASSERT(sizeof(struct dill_gendata) <= DILL_OPAQUE_SIZE);
+
+static void dill_gennext_unblock_cb(struct dill_cr *cr) {
+    struct dill_gendata *gd = (struct dill_gendata*)cr->opaque;
+    gd->producer->consumer = NULL;
+    if(gd->ddline >= 0)
+        dill_timer_rm(&cr->timer);
+}
+
+int dill_gennext(int h, void *val, size_t len, int64_t deadline,
+      const char *current) {
+    errno = 0;
+    struct dill_cr *cr = hdata(h, dill_cr_type);
+    if(dill_slow(!cr)) {
+        /* The generator has already finished. */
+        if(!errno)
+            errno = EPIPE;
+        return -1;
+    }
+    if(dill_slow(len > 0 && !val)) {errno = EINVAL; return -1;}
+    if(dill_slow(cr == dill_running)) {errno = EDEADLK; return -1;}
+    if(dill_slow(cr->consumer)) {errno = EBUSY; return -1;}
+    if(dill_slow(dill_running->canceled || dill_running->stopping)) {
+        errno = ECANCELED; return -1;}
+    if(dill_slow(deadline == 0)) {errno = ETIMEDOUT; return -1;}
+    cr->consumer = dill_running;
+    cr->genval = val;
+    cr->genlen = len;
+    struct dill_gendata *gd = (struct dill_gendata*)dill_running->opaque;
+    gd->producer = cr;
+    deadline = dill_ddline(dill_ms2us(deadline));
+    gd->ddline = deadline;
+    if(deadline >= 0)
+        dill_timer_add_us(&dill_running->timer, deadline);
+    /* If the generator is waiting to be pulled switch to it directly.
+       Otherwise wait till it gets there. */
+    int rc;
+    if(cr->genparked && !dill_slist_item_inlist(&cr->ready))
+        rc = dill_transfer(cr, 0, dill_gennext_unblock_cb);
+    else
+        rc = dill_suspend(dill_gennext_unblock_cb);
+    if(dill_slow(rc < 0)) {errno = -rc; return -1;}
+    return 0;
+}
+
+int dill_group(const char *created) {
+    struct dill_group *grp = malloc(sizeof(struct dill_group));
+    if(dill_slow(!grp)) {errno = ENOMEM; return -1;}
+    dill_list_init(&grp->members);
+    grp->nmembers = 0;
+    grp->waiter = NULL;
+    int h = dill_handle(dill_group_type, grp, &dill_group_vfptrs, created);
+    if(dill_slow(h < 0)) {
+        int err = errno;
+        free(grp);
+        errno = err;
+        return -1;
+    }
+    return h;
+}
+
+int dill_groupadd(int h, int cr, const char *current) {
+    struct dill_group *grp = hdata(h, dill_group_type);
+    if(dill_slow(!grp)) return -1;
+    errno = 0;
+    struct dill_cr *c = hdata(cr, dill_cr_type);
+    if(dill_slow(!c)) {
+        if(errno) return -1;
+        /* The coroutine has already finished. */
+        return hclose(cr);
+    }
+    if(dill_slow(c->group)) {errno = EBUSY; return -1;}
+    c->group = grp;
+    dill_list_insert(&grp->members, &c->groupitem, NULL);
+    ++grp->nmembers;
+    return 0;
+}
+
+/* The second half of groupgo(). 'cr' is the result of go(). */
+int dill_groupgo(int h, int cr, const char *current) {
+    if(dill_slow(cr < 0)) return -1;
+    int rc = dill_groupadd(h, cr, current);
+    if(dill_slow(rc < 0)) {
+        /* Don't leave the coroutine running outside of any group. */
+        int err = errno;
+        hclose(cr);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static void dill_groupwait_unblock_cb(struct dill_cr *cr) {
+    struct dill_groupdata *gd = (struct dill_groupdata*)cr->opaque;
+    gd->group->waiter = NULL;
+    if(gd->ddline >= 0)
+        dill_timer_rm(&cr->timer);
+}
+
+int dill_groupwait(int h, int64_t deadline, const char *current) {
+    struct dill_group *grp = hdata(h, dill_group_type);
+    if(dill_slow(!grp)) return -1;
+    if(!grp->nmembers)
+        return 0;
+    if(dill_slow(dill_running->canceled || dill_running->stopping)) {
+        errno = ECANCELED; return -1;}
+    if(dill_slow(grp->waiter)) {errno = EBUSY; return -1;}
+    if(dill_slow(deadline == 0)) {errno = ETIMEDOUT; return -1;}
+    struct dill_groupdata *gd = (struct dill_groupdata*)dill_running->opaque;
+    gd->group = grp;
+    deadline = dill_ddline(dill_ms2us(deadline));
+    gd->ddline = deadline;
+    if(deadline >= 0)
+        dill_timer_add_us(&dill_running->timer, deadline);
+    grp->waiter = dill_running;
+    int rc = dill_suspend(dill_groupwait_unblock_cb);
+    if(dill_slow(rc < 0)) {errno = -rc; return -1;}
+    return 0;
+}
+
+static void dill_group_close(int h) {
+    struct dill_group *grp = hdata(h, dill_group_type);
+    dill_assert(grp);
+    if(grp->waiter)
+        dill_resume(grp->waiter, -EBADF);
+    /* Ask all the members to cancel in a single pass. */
+    struct dill_list_item *it;
+    for(it = dill_list_begin(&grp->members); it; it = dill_list_next(it)) {
+        struct dill_cr *cr = dill_cont(it, struct dill_cr, groupitem);
+        cr->canceled = 1;
+        if(!dill_slist_item_inlist(&cr->ready))
+            dill_resume(cr, -ECANCELED);
+    }
+    /* Wait once till all of them finish. */
+    if(grp->nmembers) {
+        grp->waiter = dill_running;
+        int rc = dill_suspend(NULL);
+        dill_assert(rc == 0);
+    }
+    dill_assert(dill_list_empty(&grp->members));
+    free(grp);
+}
+
+static void dill_group_dump(int h) {
+    struct dill_group *grp = hdata(h, dill_group_type);
+    dill_assert(grp);
+    fprintf(stderr, "  GROUP members:%d\n", grp->nmembers);
+}
+
 int dill_yield(const char *current) {
     if(dill_slow(dill_running->canceled || dill_running->stopping)) {
         errno = ECANCELED; return -1;}
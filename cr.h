@@ -39,6 +39,7 @@
 struct dill_cr;
 
 typedef void (*dill_unblock_cb)(struct dill_cr *cr);
+typedef void (*dill_fd_cb)(struct dill_cr *cr, int fd, int events);
 
 /* The coroutine. The memory layout looks like this:
 
@@ -57,6 +58,11 @@ struct dill_cr {
     struct dill_slist_item ready;
     /* If the coroutine is waiting for a deadline, it uses this timer. */
     struct dill_timer timer;
+    /* Deadlines are rounded up to a multiple of this many microseconds. */
+    int64_t slack;
+    /* Deadline scope in microseconds. No blocking call made by the coroutine
+       waits past this point in time. -1 if there's no scope. */
+    int64_t ddline;
     /* Handle of this coroutine. */
     int hndl;
     /* When coroutine is suspended 'ctx' holds the context (registers and such),
@@ -66,6 +72,9 @@ struct dill_cr {
     sigjmp_buf ctx;
     dill_unblock_cb unblock_cb;
     int sresult;
+    /* If set, events on file descriptors the coroutine waits for are passed
+       to this function instead of resuming the coroutine directly. */
+    dill_fd_cb fd_cb;
     /* 1 if this corotine was stopped by its owner. */
     int canceled;
     /* 1 is execution is inside a 'stop' function. */
@@ -73,6 +82,21 @@ struct dill_cr {
     /* When coroutine is being waited for using hwait() this is the pointer
        to the waiting coroutine. */
     struct dill_cr *waiter;
+    /* Value passed to the waiter when the coroutine finishes. */
+    int waitidx;
+    /* Value returned by the coroutine, if launched by goresult(). */
+    intptr_t result;
+    /* If the coroutine is a generator, 'consumer' is the coroutine waiting
+       in gennext() for the next value to be stored into 'genval'. 'genparked'
+       is set while the generator waits to be pulled. */
+    struct dill_cr *consumer;
+    void *genval;
+    size_t genlen;
+    int genparked;
+    /* The group the coroutine belongs to, if any, and the member of the
+       group's list of coroutines. */
+    struct dill_group *group;
+    struct dill_list_item groupitem;
     /* Coroutine-local storage. */
     void *cls;
 #if defined DILL_VALGRIND
@@ -90,12 +114,56 @@ extern struct dill_cr dill_main;
 /* The coroutine that is running at the moment. */
 extern struct dill_cr *dill_running;
 
+/* Caps the deadline of a blocking call, in microseconds, by the deadline
+   scope of the running coroutine. */
+static inline int64_t dill_ddline(int64_t deadline) {
+    int64_t scope = dill_running->ddline;
+    if(dill_fast(scope < 0)) return deadline;
+    return deadline < 0 || deadline > scope ? scope : deadline;
+}
+
+/* Number of operations the running coroutine may still complete without
+   yielding. It's replenished each time a coroutine is scheduled. */
+#define DILL_BUDGET 64
+extern int dill_budget;
+
+/* Returns 1 if the running coroutine may complete an operation without
+   yielding to other coroutines, 0 if it's supposed to yield. */
+static inline int dill_spend(void) {
+    if(dill_slow(dill_budget <= 0)) return 0;
+    --dill_budget;
+    return 1;
+}
+
+/* State of the runtime's pseudo-random number generator. */
+extern uint64_t dill_rand_state;
+
+/* Returns a pseudo-random number in range [0, n). Uses xorshift64*, which
+   is fast and good enough for scheduling decisions, but certainly not for
+   anything security-related. */
+static inline uint32_t dill_rand(uint32_t n) {
+    uint64_t x = dill_rand_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    dill_rand_state = x;
+    uint32_t r = (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
+    /* Multiply-shift maps r to the range without a division. */
+    return (uint32_t)(((uint64_t)r * n) >> 32);
+}
+
 /* Suspend running coroutine. Move to executing different coroutines. Once
    someone resumes this coroutine using dill_resume(), unblock_cb is
    invoked immediately. dill_suspend() returns the argument passed
    to dill_resume() function. */
 int dill_suspend(dill_unblock_cb unblock_cb);
 
+/* Resumes the coroutine and switches to it straight away, bypassing the
+   queue of ready coroutines. The running coroutine is suspended as if by
+   dill_suspend(). If the running coroutine has exhausted its budget it's
+   equivalent to dill_resume() followed by dill_suspend(). */
+int dill_transfer(struct dill_cr *cr, int result, dill_unblock_cb unblock_cb);
+
 /* Schedules preiously suspended coroutine for execution. Keep in mind that
    it doesn't immediately run it, just puts it into the queue of ready
    coroutines. */
@@ -31,6 +31,12 @@ void dotrace(int level) {
     dill_tracelevel = level;
 }
 
+int dill_chstats_enabled = 0;
+
+void dochstats(int enable) {
+    dill_chstats_enabled = enable;
+}
+
 void dill_preserve_debug(void) {
     /* Do nothing, but trick the compiler into thinking that the debug
        functions are being used so that it does not optimise them away. */
@@ -39,5 +45,6 @@ void dill_preserve_debug(void) {
         return;
     goredump();
     dotrace(0);
+    dochstats(0);
 }
 
@@ -30,4 +30,7 @@
 /* No-op, but ensures that debugging functions get compiled into the binary. */
 void dill_preserve_debug(void);
 
+/* Non-zero if channel statistics are being collected. */
+extern int dill_chstats_enabled;
+
 #endif
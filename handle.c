@@ -95,6 +95,7 @@ int dill_handle(const void *type, void *data, const struct hvfptrs *vfptrs,
     dill_handles[h].refcount = 1;
     dill_handles[h].vfptrs = *vfptrs;
     dill_handles[h].created = created;
+    dill_handles[h].result = 0;
     dill_handles[h].next = -2;
     return h;
 }
@@ -143,9 +144,15 @@ int hclose(int h) {
     return 0;
 }
 
-void dill_handle_done(int h) {
+void dill_handle_done(int h, intptr_t result) {
     CHECKHANDLEASSERT(h);
     hndl->data = NULL;
+    hndl->result = result;
+}
+
+intptr_t dill_handle_result(int h) {
+    CHECKHANDLEASSERT(h);
+    return hndl->result;
 }
 
 void goredump(void) {
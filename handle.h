@@ -39,12 +39,19 @@ struct dill_handle {
     /* The location where the handle was created. The string it points to must
        be static. */
     const char *created;
+    /* Value returned by the coroutine. Valid once 'data' is NULL. */
+    intptr_t result;
     /* Index of the next handle in the linked list of unused handles. -1 means
        'end of the list'. -2 means 'active handle'. */
     int next;
 };
 
-void dill_handle_done(int h);
+/* Marks the coroutine the handle points to as finished and stores
+   the value it returned. */
+void dill_handle_done(int h, intptr_t result);
+
+/* Returns the value stored by dill_handle_done(). */
+intptr_t dill_handle_result(int h);
 
 #endif
 
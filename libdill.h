@@ -80,6 +80,49 @@
 
 DILL_EXPORT int64_t now(void);
 
+/* Same as now(), in microseconds. Deadlines passed to the functions with
+   _us suffix are expressed in these units. */
+DILL_EXPORT int64_t now_us(void);
+
+/* Deadlines of the running coroutine are rounded up to the next multiple of
+   'slack' milliseconds so that timers expiring at about the same time fire
+   together in a single wakeup. Coroutines inherit the setting from their
+   parent. Zero, the default, disables the rounding. */
+DILL_EXPORT int timerslack(int64_t slack);
+
+/* Sets the deadline scope of the running coroutine. Blocking calls made
+   afterwards time out at this point in time at the latest, whatever
+   deadline is passed to them. msleep() cut short by the scope fails with
+   ETIMEDOUT. Coroutines inherit the scope from their
+   parent at the moment they are launched. -1, the default, removes
+   the scope. */
+DILL_EXPORT int setdeadline(int64_t deadline);
+DILL_EXPORT int setdeadline_us(int64_t deadline);
+
+/* Returns the deadline scope of the running coroutine, -1 if there's none. */
+DILL_EXPORT int64_t getdeadline(void);
+DILL_EXPORT int64_t getdeadline_us(void);
+
+/* Timer statistics. */
+struct timerstats {
+    /* Number of times the process blocked waiting for events. */
+    uint64_t waits;
+    /* Number of those waits that ended with some timers firing. */
+    uint64_t timer_wakeups;
+    /* Number of timers that have fired. */
+    uint64_t fired;
+    /* Number of times firing was cut short by the timer budget. */
+    uint64_t deferred;
+};
+
+DILL_EXPORT int timerstats(struct timerstats *stats);
+
+/* Limits the number of timers fired in a single pass of the scheduler.
+   Expired timers beyond the limit fire in the following passes, after
+   pending I/O events were processed. This keeps mass expiry from delaying
+   I/O. Zero, the default, means no limit. */
+DILL_EXPORT int timerbudget(int budget);
+
 /******************************************************************************/
 /*  Handles                                                                   */
 /******************************************************************************/
@@ -124,7 +167,7 @@ DILL_EXPORT void dill_proc_epilogue(void);
 /* Statement expressions are a gcc-ism but they are also supported by clang.
    Given that there's no other way to do this, screw other compilers for now.
    See https://gcc.gnu.org/onlinedocs/gcc-3.2/gcc/Statement-Exprs.html */
-#define go(fn) \
+#define dill_go(fn) \
     ({\
         sigjmp_buf *ctx;\
         int h = dill_prologue(&ctx, __FILE__ ":" dill_string(__LINE__));\
@@ -141,6 +184,12 @@ DILL_EXPORT void dill_proc_epilogue(void);
         h;\
     })
 
+#define go(fn) dill_go(fn)
+
+/* Launches a coroutine whose return value, converted to intptr_t, can be
+   retrieved using cojoin() or cojoinany(). */
+#define goresult(fn) dill_go(dill_setresult((intptr_t)(fn)))
+
 #define proc(fn) \
     ({\
         int hndl;\
@@ -151,6 +200,26 @@ DILL_EXPORT void dill_proc_epilogue(void);
         hndl;\
     })
 
+/* Coroutines can be added to a group. Closing the group cancels all of its
+   members and waits for them to finish. Once added, the coroutine's handle
+   is owned by the group and must not be used. */
+#define group() dill_group(__FILE__ ":" dill_string(__LINE__))
+#define groupadd(grp, cr) \
+    dill_groupadd((grp), (cr), __FILE__ ":" dill_string(__LINE__))
+#define groupgo(grp, fn) \
+    ({\
+        int dill_grpcr = go(fn);\
+        dill_groupgo((grp), dill_grpcr, __FILE__ ":" dill_string(__LINE__));\
+    })
+#define groupwait(grp, deadline) \
+    dill_groupwait((grp), (deadline), __FILE__ ":" dill_string(__LINE__))
+
+DILL_EXPORT int dill_group(const char *created);
+DILL_EXPORT int dill_groupadd(int grp, int cr, const char *current);
+DILL_EXPORT int dill_groupgo(int grp, int cr, const char *current);
+DILL_EXPORT int dill_groupwait(int grp, int64_t deadline,
+    const char *current);
+
 #define FDW_IN 1
 #define FDW_OUT 2
 #define FDW_ERR 4
@@ -160,12 +229,45 @@ DILL_EXPORT void dill_proc_epilogue(void);
     __FILE__ ":" dill_string(__LINE__))
 #define fdwait(fd, events, deadline) dill_fdwait((fd), (events), (deadline),\
     __FILE__ ":" dill_string(__LINE__))
+#define msleep_us(deadline) dill_msleep_us((deadline),\
+    __FILE__ ":" dill_string(__LINE__))
+#define fdwait_us(fd, events, deadline) dill_fdwait_us((fd), (events),\
+    (deadline), __FILE__ ":" dill_string(__LINE__))
+
+#define cojoin(cr, result, deadline) \
+    dill_cojoin((cr), (result), (deadline), \
+    __FILE__ ":" dill_string(__LINE__))
+#define cojoinany(crs, ncrs, result, deadline) \
+    dill_cojoinany((crs), (ncrs), (result), (deadline), \
+    __FILE__ ":" dill_string(__LINE__))
+
+/* A generator is a coroutine that passes values to its consumer using
+   genyield(). The consumer pulls them using gennext(). Control is passed
+   between the two directly, without going through the scheduler. Once
+   the generator finishes, gennext() fails with EPIPE. */
+#define genyield(val, len) \
+    dill_genyield((val), (len), __FILE__ ":" dill_string(__LINE__))
+#define gennext(cr, val, len, deadline) \
+    dill_gennext((cr), (val), (len), (deadline), \
+    __FILE__ ":" dill_string(__LINE__))
 
+DILL_EXPORT int dill_genyield(const void *val, size_t len,
+    const char *current);
+DILL_EXPORT int dill_gennext(int cr, void *val, size_t len, int64_t deadline,
+    const char *current);
+DILL_EXPORT void dill_setresult(intptr_t result);
+DILL_EXPORT int dill_cojoin(int cr, intptr_t *result, int64_t deadline,
+    const char *current);
+DILL_EXPORT int dill_cojoinany(int *crs, int ncrs, intptr_t *result,
+    int64_t deadline, const char *current);
 DILL_EXPORT int dill_yield(const char *current);
 DILL_EXPORT int dill_msleep(int64_t deadline, const char *current);
+DILL_EXPORT int dill_msleep_us(int64_t deadline, const char *current);
 DILL_EXPORT void fdclean(int fd);
 DILL_EXPORT int dill_fdwait(int fd, int events, int64_t deadline,
     const char *current);
+DILL_EXPORT int dill_fdwait_us(int fd, int events, int64_t deadline,
+    const char *current);
 DILL_EXPORT void *cls(void);
 DILL_EXPORT void setcls(void *val);
 
@@ -175,6 +277,14 @@ DILL_EXPORT void setcls(void *val);
 
 #define CHSEND 1
 #define CHRECV 2
+#define CHFDIN 3
+#define CHFDOUT 4
+#define CHHIGH 5
+#define CHLOW 6
+
+#define CHBLOCK 0
+#define CHOVERWRITE 1
+#define CHDROP 2
 
 struct chclause {
     int h;
@@ -189,9 +299,41 @@ struct chclause {
     int reserved6;
 };
 
+/* Number of buckets in the occupancy histogram. Bucket 0 counts operations
+   that found the channel empty, bucket i those that found it holding
+   2^(i-1) to 2^i-1 messages. The last bucket collects everything above. */
+#define CHSTATS_BUCKETS 8
+
+/* Channel statistics. They are collected only while enabled by dochstats(). */
+struct chstats {
+    /* Number of messages sent to and received from the channel. */
+    uint64_t sent;
+    uint64_t received;
+    /* Messages lost because of the overflow policy. */
+    uint64_t dropped;
+    /* Time, in milliseconds, senders and receivers spent blocked. */
+    int64_t send_blocked;
+    int64_t recv_blocked;
+    /* Maximum number of messages buffered in the channel at any one time. */
+    size_t hwm;
+    /* Number of messages in the channel as seen by each send and receive. */
+    uint64_t occupancy[CHSTATS_BUCKETS];
+};
+
 #define channel(itemsz, bufsz) \
     dill_channel((itemsz), (bufsz), __FILE__ ":" dill_string(__LINE__))
 
+#define uchannel(itemsz, limit) \
+    dill_uchannel((itemsz), (limit), __FILE__ ":" dill_string(__LINE__))
+
+/* A channel shared with child processes created by proc(). It has to be
+   created before the child is launched. Messages can be passed using
+   chsend() and chrecv() but the channel can't be used in choose(). Each
+   direction supports a single sending and a single receiving process and
+   only one coroutine per process can be blocked on either side at a time. */
+#define shchannel(itemsz, bufsz) \
+    dill_shchannel((itemsz), (bufsz), __FILE__ ":" dill_string(__LINE__))
+
 #define chsend(channel, val, len, deadline) \
     dill_chsend((channel), (val), (len), (deadline), \
     __FILE__ ":" dill_string(__LINE__))
@@ -200,6 +342,14 @@ struct chclause {
     dill_chrecv((channel), (val), (len), (deadline), \
     __FILE__ ":" dill_string(__LINE__))
 
+#define chsend_us(channel, val, len, deadline) \
+    dill_chsend_us((channel), (val), (len), (deadline), \
+    __FILE__ ":" dill_string(__LINE__))
+
+#define chrecv_us(channel, val, len, deadline) \
+    dill_chrecv_us((channel), (val), (len), (deadline), \
+    __FILE__ ":" dill_string(__LINE__))
+
 #define chdone(channel) \
     dill_chdone((channel), __FILE__ ":" dill_string(__LINE__))
 
@@ -207,14 +357,144 @@ struct chclause {
     dill_choose((clauses), (nclauses), (deadline), \
     __FILE__ ":" dill_string(__LINE__))
 
+#define choose_us(clauses, nclauses, deadline) \
+    dill_choose_us((clauses), (nclauses), (deadline), \
+    __FILE__ ":" dill_string(__LINE__))
+
+#define choosefirst(clauses, nclauses, deadline) \
+    dill_choosefirst((clauses), (nclauses), (deadline), \
+    __FILE__ ":" dill_string(__LINE__))
+
+#define chooseweighted(clauses, nclauses, weights, deadline) \
+    dill_chooseweighted((clauses), (nclauses), (weights), (deadline), \
+    __FILE__ ":" dill_string(__LINE__))
+
+/* Once the number of messages in the channel reaches 'high' the channel
+   becomes congested. It stops being congested when the number drops to
+   'low'. CHHIGH and CHLOW clauses in choose() fire when the channel is,
+   respectively is not, congested. They take no value. Setting 'high' to
+   zero switches the watermarks off. CHHIGH and CHLOW clauses on a channel
+   without watermarks fail with EINVAL, as do those waiting when the
+   watermarks are switched off. After chdone() they fail with EPIPE. */
+#define chwatermarks(channel, high, low) \
+    dill_chwatermarks((channel), (high), (low), \
+    __FILE__ ":" dill_string(__LINE__))
+
+/* Sets what happens when a message is sent to a full buffered channel.
+   CHBLOCK, the default, blocks the sender. CHOVERWRITE replaces the oldest
+   message in the buffer. CHDROP throws the new message away. In either of
+   the latter cases chsend() succeeds immediately. */
+#define chpolicy(channel, policy) \
+    dill_chpolicy((channel), (policy), __FILE__ ":" dill_string(__LINE__))
+
+/* Ticker is a channel that receives a tick every 'period' milliseconds.
+   Each message is an uint64_t holding the number of ticks since the last
+   message was received, so that ticks missed by a slow receiver are
+   reported rather than queued. Ticks are scheduled relative to the creation
+   time and don't drift. The channel can be used in chrecv() and choose(),
+   but not sent to. */
+#define ticker(period) \
+    dill_ticker((period), __FILE__ ":" dill_string(__LINE__))
+#define ticker_us(period) \
+    dill_ticker_us((period), __FILE__ ":" dill_string(__LINE__))
+
+#define chselector(clauses, nclauses) \
+    dill_chselector((clauses), (nclauses), \
+    __FILE__ ":" dill_string(__LINE__))
+
+#define chselect(sel, deadline) \
+    dill_chselect((sel), (deadline), __FILE__ ":" dill_string(__LINE__))
+
+/* Declares type-safe channel functions for messages of the given type:
+
+       int name_channel(size_t bufsz);
+       int name_send(int ch, type val, int64_t deadline);
+       int name_recv(int ch, type *val, int64_t deadline);
+
+   The message size is a compile-time constant, so it's always the same
+   as the one the channel was created with. */
+#define CHTYPE(name, type) \
+    static inline int name##_channel(size_t bufsz) {\
+        return dill_channel(sizeof(type), bufsz,\
+            __FILE__ ":" dill_string(__LINE__));\
+    }\
+    static inline int name##_send(int ch, type val, int64_t deadline) {\
+        return dill_chsend(ch, &val, sizeof(type), deadline,\
+            __FILE__ ":" dill_string(__LINE__));\
+    }\
+    static inline int name##_recv(int ch, type *val, int64_t deadline) {\
+        return dill_chrecv(ch, val, sizeof(type), deadline,\
+            __FILE__ ":" dill_string(__LINE__));\
+    }
+
 DILL_EXPORT int dill_channel(size_t itemsz, size_t bufsz, const char *created);
+DILL_EXPORT int dill_uchannel(size_t itemsz, size_t limit,
+    const char *created);
+DILL_EXPORT int dill_shchannel(size_t itemsz, size_t bufsz,
+    const char *created);
 DILL_EXPORT int dill_chsend(int ch, const void *val, size_t len,
     int64_t deadline, const char *current);
 DILL_EXPORT int dill_chrecv(int ch, void *val, size_t len,
     int64_t deadline, const char *current);
+DILL_EXPORT int dill_chsend_us(int ch, const void *val, size_t len,
+    int64_t deadline, const char *current);
+DILL_EXPORT int dill_chrecv_us(int ch, void *val, size_t len,
+    int64_t deadline, const char *current);
 DILL_EXPORT int dill_chdone(int ch, const char *current);
 DILL_EXPORT int dill_choose(struct chclause *clauses, int nclauses,
     int64_t deadline, const char *current);
+DILL_EXPORT int dill_choose_us(struct chclause *clauses, int nclauses,
+    int64_t deadline, const char *current);
+DILL_EXPORT int dill_choosefirst(struct chclause *clauses, int nclauses,
+    int64_t deadline, const char *current);
+DILL_EXPORT int dill_chooseweighted(struct chclause *clauses, int nclauses,
+    const int *weights, int64_t deadline, const char *current);
+DILL_EXPORT int dill_chwatermarks(int ch, size_t high, size_t low,
+    const char *current);
+DILL_EXPORT int dill_chpolicy(int ch, int policy, const char *current);
+DILL_EXPORT int dill_ticker(int64_t period, const char *created);
+DILL_EXPORT int dill_ticker_us(int64_t period, const char *created);
+DILL_EXPORT int dill_chselector(struct chclause *clauses, int nclauses,
+    const char *created);
+DILL_EXPORT int dill_chselect(int sel, int64_t deadline, const char *current);
+DILL_EXPORT int chstats(int ch, struct chstats *stats);
+
+/******************************************************************************/
+/*  Synchronisation                                                           */
+/******************************************************************************/
+
+#define mutex() dill_mutex(__FILE__ ":" dill_string(__LINE__))
+#define mutexlock(m, deadline) \
+    dill_mutexlock((m), (deadline), __FILE__ ":" dill_string(__LINE__))
+#define mutexunlock(m) \
+    dill_mutexunlock((m), __FILE__ ":" dill_string(__LINE__))
+
+#define semaphore(value) \
+    dill_semaphore((value), __FILE__ ":" dill_string(__LINE__))
+#define semacquire(s, deadline) \
+    dill_semacquire((s), (deadline), __FILE__ ":" dill_string(__LINE__))
+#define semrelease(s) \
+    dill_semrelease((s), __FILE__ ":" dill_string(__LINE__))
+
+#define condvar() dill_condvar(__FILE__ ":" dill_string(__LINE__))
+#define condwait(cv, m, deadline) \
+    dill_condwait((cv), (m), (deadline), __FILE__ ":" dill_string(__LINE__))
+#define condsignal(cv) \
+    dill_condsignal((cv), __FILE__ ":" dill_string(__LINE__))
+#define condbroadcast(cv) \
+    dill_condbroadcast((cv), __FILE__ ":" dill_string(__LINE__))
+
+DILL_EXPORT int dill_mutex(const char *created);
+DILL_EXPORT int dill_mutexlock(int m, int64_t deadline, const char *current);
+DILL_EXPORT int dill_mutexunlock(int m, const char *current);
+DILL_EXPORT int dill_semaphore(int value, const char *created);
+DILL_EXPORT int dill_semacquire(int s, int64_t deadline, const char *current);
+DILL_EXPORT int dill_semrelease(int s, const char *current);
+DILL_EXPORT int dill_condvar(const char *created);
+DILL_EXPORT int dill_condwait(int cv, int m, int64_t deadline,
+    const char *current);
+DILL_EXPORT int dill_condsignal(int cv, const char *current);
+DILL_EXPORT int dill_condbroadcast(int cv, const char *current);
 
 /******************************************************************************/
 /*  Debugging                                                                 */
@@ -222,6 +502,17 @@ DILL_EXPORT int dill_choose(struct chclause *clauses, int nclauses,
 
 DILL_EXPORT void goredump(void);
 DILL_EXPORT void dotrace(int level);
+DILL_EXPORT void dochstats(int enable);
+
+/* Switches to virtual time, meant for testing. The clock doesn't advance
+   on its own. Instead, whenever all coroutines are blocked and there are
+   no events on file descriptors, it jumps straight to the next deadline.
+   Together with the deterministic scheduling order that makes hours of
+   timeouts run in a fraction of a second, the same way every time. Should
+   be switched on before any deadlines are set. When switched off, the clock
+   carries on from the virtual time at the real pace rather than going back
+   to the real time. */
+DILL_EXPORT void dovirtualtime(int enable);
 
 #endif
 
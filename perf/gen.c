@@ -0,0 +1,77 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../libdill.h"
+
+coroutine void generator(long count) {
+    long i;
+    for(i = 0; i != count; ++i)
+        genyield(&i, sizeof(i));
+}
+
+coroutine void producer(int ch, long count) {
+    long i;
+    for(i = 0; i != count; ++i)
+        chsend(ch, &i, sizeof(i), -1);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        printf("usage: gen <millions-of-values>\n");
+        return 1;
+    }
+    long count = atol(argv[1]) * 1000000;
+    long val;
+    long i;
+
+    int g = go(generator(count));
+    assert(g >= 0);
+    int64_t start = now();
+    for(i = 0; i != count; ++i)
+        gennext(g, &val, sizeof(val), -1);
+    long duration = (long)(now() - start);
+    printf("generator: %ld ns per value\n", duration * 1000000 / count);
+    hclose(g);
+
+    int ch = channel(sizeof(long), 0);
+    assert(ch >= 0);
+    int p = go(producer(ch, count));
+    assert(p >= 0);
+    start = now();
+    for(i = 0; i != count; ++i)
+        chrecv(ch, &val, sizeof(val), -1);
+    duration = (long)(now() - start);
+    printf("unbuffered channel: %ld ns per value\n",
+        duration * 1000000 / count);
+    hclose(p);
+    hclose(ch);
+
+    return 0;
+}
+
@@ -0,0 +1,74 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../libdill.h"
+
+coroutine void worker(void) {
+    msleep(-1);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        printf("usage: group <thousands-of-coroutines>\n");
+        return 1;
+    }
+    long count = atol(argv[1]) * 1000;
+    int *hndls = malloc(count * sizeof(int));
+    assert(hndls);
+
+    /* Cancel the coroutines one by one. */
+    long i;
+    for(i = 0; i != count; ++i) {
+        hndls[i] = go(worker());
+        assert(hndls[i] >= 0);
+    }
+    int64_t start = now();
+    for(i = 0; i != count; ++i)
+        hclose(hndls[i]);
+    long duration = (long)(now() - start);
+    printf("closing coroutines one by one: %ld ns per coroutine\n",
+        duration * 1000000 / count);
+
+    /* Cancel them as a group. */
+    int grp = group();
+    assert(grp >= 0);
+    for(i = 0; i != count; ++i) {
+        int rc = groupgo(grp, worker());
+        assert(rc == 0);
+    }
+    start = now();
+    hclose(grp);
+    duration = (long)(now() - start);
+    printf("closing a group: %ld ns per coroutine\n",
+        duration * 1000000 / count);
+
+    free(hndls);
+    return 0;
+}
+
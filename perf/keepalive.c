@@ -0,0 +1,116 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../libdill.h"
+
+/* Mimics a server with many idle keepalive connections. Each connection
+   waits for input with an idle timeout. Every time a message arrives the
+   timeout is cancelled and started anew. */
+
+static long events = 0;
+static long timeouts = 0;
+
+coroutine void connection(int fd, int64_t idle) {
+    while(1) {
+        int rc = fdwait(fd, FDW_IN, now() + idle);
+        if(rc < 0 && errno == ECANCELED)
+            return;
+        if(rc < 0) {
+            assert(errno == ETIMEDOUT);
+            ++timeouts;
+            continue;
+        }
+        char c;
+        ssize_t sz = read(fd, &c, 1);
+        assert(sz == 1);
+        ++events;
+    }
+}
+
+static int64_t cputime(void) {
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    assert(rc == 0);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 4) {
+        printf("usage: keepalive <connections> <idle-timeout-ms> <seconds>\n");
+        return 1;
+    }
+    long count = atol(argv[1]);
+    int64_t idle = atol(argv[2]);
+    int64_t duration = atol(argv[3]) * 1000;
+
+    int *peers = malloc(sizeof(int) * count);
+    assert(peers);
+    int grp = group();
+    assert(grp >= 0);
+    long i;
+    for(i = 0; i != count; ++i) {
+        int fds[2];
+        int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        assert(rc == 0);
+        peers[i] = fds[1];
+        rc = groupgo(grp, connection(fds[0], idle));
+        assert(rc >= 0);
+    }
+
+    /* Send messages to randomly chosen connections, a batch at a time,
+       and let the connections process them. */
+    int64_t start = now();
+    int64_t cpu = cputime();
+    while(now() - start < duration) {
+        for(i = 0; i != 64; ++i) {
+            char c = 0;
+            ssize_t sz = write(peers[random() % count], &c, 1);
+            assert(sz == 1);
+        }
+        int rc = msleep(now());
+        assert(rc == 0);
+    }
+    cpu = cputime() - cpu;
+    int64_t stop = now();
+
+    printf("%ld connections, %ld messages and %ld timeouts in %f seconds\n",
+        count, events, timeouts, ((float)(stop - start)) / 1000);
+    printf("CPU time per message or timeout: %ld ns\n",
+        (long)(cpu / (events + timeouts)));
+
+    hclose(grp);
+    for(i = 0; i != count; ++i)
+        close(peers[i]);
+    free(peers);
+    return 0;
+}
@@ -0,0 +1,122 @@
+/*
+
+  Copyright (c) 2015 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../libdill.h"
+
+/* Each coroutine takes the lock, yields while holding it and releases it.
+   The lock is implemented either as a mutex or as a channel holding
+   a single token. */
+static int finished = 0;
+
+coroutine void mtxworker(int m, long count) {
+    long i;
+    for(i = 0; i != count; ++i) {
+        int rc = mutexlock(m, -1);
+        assert(rc == 0);
+        yield();
+        rc = mutexunlock(m);
+        assert(rc == 0);
+    }
+    ++finished;
+}
+
+coroutine void chworker(int ch, long count) {
+    long i;
+    for(i = 0; i != count; ++i) {
+        char token;
+        int rc = chrecv(ch, &token, sizeof(token), -1);
+        assert(rc == 0);
+        yield();
+        rc = chsend(ch, &token, sizeof(token), -1);
+        assert(rc == 0);
+    }
+    ++finished;
+}
+
+static void report(const char *name, int64_t start, long count) {
+    long duration = (long)(now() - start);
+    printf("%s: %ld ns per lock/unlock\n", name,
+        duration * 1000000 / count);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        printf("usage: sync <millions-of-locks>\n");
+        return 1;
+    }
+    long count = atol(argv[1]) * 1000000;
+
+    /* Uncontended. */
+    int m = mutex();
+    assert(m >= 0);
+    int64_t start = now();
+    long i;
+    for(i = 0; i != count; ++i) {
+        mutexlock(m, -1);
+        mutexunlock(m);
+    }
+    report("uncontended mutex", start, count);
+
+    int ch = channel(sizeof(char), 1);
+    assert(ch >= 0);
+    char token = 0;
+    int rc = chsend(ch, &token, sizeof(token), -1);
+    assert(rc == 0);
+    start = now();
+    for(i = 0; i != count; ++i) {
+        chrecv(ch, &token, sizeof(token), -1);
+        chsend(ch, &token, sizeof(token), -1);
+    }
+    report("uncontended channel", start, count);
+
+    /* Contended by four coroutines. */
+    int hndls[4];
+    start = now();
+    for(i = 0; i != 4; ++i)
+        hndls[i] = go(mtxworker(m, count / 4));
+    while(finished != 4)
+        yield();
+    report("contended mutex", start, count);
+    for(i = 0; i != 4; ++i)
+        hclose(hndls[i]);
+
+    start = now();
+    for(i = 0; i != 4; ++i)
+        hndls[i] = go(chworker(ch, count / 4));
+    while(finished != 8)
+        yield();
+    report("contended channel", start, count);
+
+    for(i = 0; i != 4; ++i)
+        hclose(hndls[i]);
+    hclose(ch);
+    hclose(m);
+    return 0;
+}
+
@@ -0,0 +1,152 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../libdill.h"
+
+/* Pending timers are tickers. A ticker is a timer with no coroutine and no
+   stack behind it, so a million of them fit in memory easily. The clock is
+   frozen while they are created so that all deadlines are exact. */
+
+#define RANDOM 0
+#define MONOTONIC 1
+#define IDENTICAL 2
+
+static const char *patterns[] = {"random", "monotonic", "identical"};
+
+/* Virtual time doesn't move by itself. The real clock is used to measure
+   the elapsed time. */
+static int64_t wallclock(void) {
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(rc == 0);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Period of the i-th of n tickers, in microseconds. All the tickers fire
+   within a second, starting a second from now. Periods are whole
+   milliseconds so that there are at most a thousand distinct deadlines
+   and thus a thousand passes of the scheduler to fire them all. */
+static int64_t period(int pattern, long i, long n) {
+    switch(pattern) {
+    case RANDOM:
+        return 1000000 + random() % 1000 * 1000;
+    case MONOTONIC:
+        return 1000000 + (int64_t)i * 1000 / n * 1000;
+    default:
+        return 1000000;
+    }
+}
+
+/* Each measurement is done this many times and the best result is reported
+   so that one-off costs like growing the handle table or initialising the
+   poller don't skew the results. */
+#define ROUNDS 3
+
+static void timers(int pattern, long n, int *tks) {
+    int64_t insert = INT64_MAX;
+    int64_t fire = INT64_MAX;
+    int64_t cancel = INT64_MAX;
+    int round;
+    for(round = 0; round != ROUNDS; ++round) {
+        int64_t start = now_us();
+        /* Insert. */
+        int64_t t = wallclock();
+        long i;
+        for(i = 0; i != n; ++i) {
+            tks[i] = ticker_us(period(pattern, i, n));
+            assert(tks[i] >= 0);
+        }
+        t = wallclock() - t;
+        if(t < insert)
+            insert = t;
+        /* Fire. Each ticker fires once and re-arms itself. */
+        t = wallclock();
+        int rc = msleep_us(start + 2000000 - 1);
+        assert(rc == 0);
+        t = wallclock() - t;
+        if(t < fire)
+            fire = t;
+        /* Cancel. Closing a ticker removes its timer from the wheel. */
+        t = wallclock();
+        for(i = 0; i != n; ++i) {
+            rc = hclose(tks[i]);
+            assert(rc == 0);
+        }
+        t = wallclock() - t;
+        if(t < cancel)
+            cancel = t;
+    }
+    printf("%8ldk %-10s insert: %5ld ns  fire: %5ld ns  cancel: %5ld ns\n",
+        n / 1000, patterns[pattern], (long)(insert / n), (long)(fire / n),
+        (long)(cancel / n));
+}
+
+/* Measures how late the running coroutine wakes up from msleep_us(). */
+static void accuracy(long n) {
+    int64_t total = 0;
+    int64_t worst = 0;
+    long i;
+    for(i = 0; i != n; ++i) {
+        int64_t deadline = now_us() + 100 + random() % 1000;
+        int rc = msleep_us(deadline);
+        assert(rc == 0);
+        int64_t late = now_us() - deadline;
+        assert(late >= 0);
+        total += late;
+        if(late > worst)
+            worst = late;
+    }
+    printf("wakeup latency: %ld us on average, %ld us at worst\n",
+        (long)(total / n), (long)worst);
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        printf("usage: timer <max-thousands-of-timers>\n");
+        return 1;
+    }
+    long max = atol(argv[1]) * 1000;
+    int *tks = malloc(sizeof(int) * max);
+    assert(tks);
+    long n;
+    int pattern;
+    /* Each round closes its tickers so the wheel is empty when the next
+       one starts. */
+    dovirtualtime(1);
+    for(n = 1000; n <= max; n *= 10) {
+        for(pattern = RANDOM; pattern <= IDENTICAL; ++pattern)
+            timers(pattern, n, tks);
+    }
+    free(tks);
+    /* Wakeup latency is measured against the real clock. */
+    dovirtualtime(0);
+    accuracy(1000);
+    return 0;
+}
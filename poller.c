@@ -37,11 +37,45 @@ void dill_poller_init(void);
 static int dill_poller_add(int fd, int events);
 static void dill_poller_rm(int fd, int events);
 static void dill_poller_clean(int fd);
-static int dill_poller_wait(int timeout);
+static int dill_poller_wait(int64_t timeout);
 
 /* If 1, dill_poller_init was already called. */
 static int dill_poller_initialised = 0;
 
+/* Called by the poller mechanisms when there's an event on a file
+   descriptor. The coroutine may have been resumed by a different event
+   in the same batch, in which case it was already removed from the pollset
+   and 'cr' is NULL. */
+static void dill_poller_resume(struct dill_cr *cr, int fd, int events) {
+    if(dill_slow(!cr))
+        return;
+    if(cr->fd_cb) {
+        cr->fd_cb(cr, fd, events);
+        return;
+    }
+    dill_resume(cr, events);
+}
+
+/* Per-coroutine data. Used to store info while fdwait() is blocked. */
+struct dill_fdwaitdata {
+    int fd;
+    int events;
+    int64_t ddline;
+};
+
+DILL_CT_ASSERT(sizeof(struct dill_fdwaitdata) <= DILL_OPAQUE_SIZE);
+
+/* Whatever resumed the coroutine, the file descriptor and the timer must
+   not be able to resume it once again before it gets to run. */
+static void dill_fdwait_unblock_cb(struct dill_cr *cr) {
+    struct dill_fdwaitdata *fwd = (struct dill_fdwaitdata*)cr->opaque;
+    if(fwd->fd >= 0)
+        dill_poller_rm(fwd->fd, fwd->events);
+    if(fwd->ddline >= 0)
+        dill_timer_rm(&cr->timer);
+}
+
+/* The deadline is in microseconds. */
 static int dill_fdwait_(int fd, int events, int64_t deadline,
       const char *current) {
     if(dill_slow(dill_running->canceled || dill_running->stopping)) {
@@ -60,21 +94,16 @@ static int dill_fdwait_(int fd, int events, int64_t deadline,
             return -1;
     }
     /* If required, start waiting for the timeout. */
+    deadline = dill_ddline(deadline);
     if(deadline >= 0)
-        dill_timer_add(&dill_running->timer, deadline);
+        dill_timer_add_us(&dill_running->timer, deadline);
     /* Do actual waiting. */
-    int rc = dill_suspend(NULL);
-    /* Handle file descriptor events. */
-    if(rc >= 0) {
-        if(deadline >= 0)
-            dill_timer_rm(&dill_running->timer);
-        return rc;
-    }
-    /* Clean up the pollset and the timer. */
-    if(rc < 0 && fd >= 0)
-        dill_poller_rm(fd, events);
-    if(deadline >= 0 && rc != -ETIMEDOUT)
-        dill_timer_rm(&dill_running->timer);
+    struct dill_fdwaitdata *fwd =
+        (struct dill_fdwaitdata*)dill_running->opaque;
+    fwd->fd = fd;
+    fwd->events = events;
+    fwd->ddline = deadline;
+    int rc = dill_suspend(dill_fdwait_unblock_cb);
     if(dill_slow(rc < 0)) {
         errno = -rc;
         return -1;
@@ -82,15 +111,23 @@ static int dill_fdwait_(int fd, int events, int64_t deadline,
     return rc;
 }
 
-int dill_msleep(int64_t deadline, const char *current) {
+int dill_msleep_us(int64_t deadline, const char *current) {
     int rc = dill_fdwait_(-1, 0, deadline, current);
     dill_assert(rc == -1);
-    if(errno == ETIMEDOUT)
-        return 0;
-    return -1;
+    if(errno != ETIMEDOUT)
+        return -1;
+    /* Waking up early because of the deadline scope is a timeout. */
+    if(dill_slow(dill_ddline(deadline) != deadline))
+        return -1;
+    return 0;
 }
 
-int dill_fdwait(int fd, int events, int64_t deadline, const char *current) {
+int dill_msleep(int64_t deadline, const char *current) {
+    return dill_msleep_us(dill_ms2us(deadline), current);
+}
+
+int dill_fdwait_us(int fd, int events, int64_t deadline,
+      const char *current) {
     if(dill_slow(fd < 0 || events < 0))  {
         errno = EINVAL;
         return -1;
@@ -98,6 +135,23 @@ int dill_fdwait(int fd, int events, int64_t deadline, const char *current) {
     return dill_fdwait_(fd, events, deadline, current);
 }
 
+int dill_fdwait(int fd, int events, int64_t deadline, const char *current) {
+    return dill_fdwait_us(fd, events, dill_ms2us(deadline), current);
+}
+
+int dill_fdwait_add(int fd, int events) {
+    if(dill_slow(!dill_poller_initialised)) {
+        dill_poller_init();
+        dill_assert(errno == 0);
+        dill_poller_initialised = 1;
+    }
+    return dill_poller_add(fd, events);
+}
+
+void dill_fdwait_rm(int fd, int events) {
+    dill_poller_rm(fd, events);
+}
+
 void fdclean(int fd) {
     if(dill_slow(!dill_poller_initialised)) {
         dill_poller_init();
@@ -115,11 +169,21 @@ void dill_wait(int block) {
     }
     while(1) {
         /* Compute timeout for the subsequent poll. */
-        int timeout = block ? dill_timer_next() : 0;
+        int64_t timeout = block ? dill_timer_next() : 0;
+        /* With virtual time the process never sleeps. If there are no
+           events the clock is moved straight to the next expiry. */
+        int jump = dill_slow(dill_timer_virtual) && timeout > 0;
         /* Wait for events. */
-        int fd_fired = dill_poller_wait(timeout);
-        /* Fire all expired timers. */
+        int fd_fired = dill_poller_wait(jump ? 0 : timeout);
+        if(jump && !fd_fired)
+            dill_timer_jump(timeout);
+        /* Fire the expired timers. */
         int timer_fired = dill_timer_fire();
+        if(timeout != 0) {
+            ++dill_timer_stats.waits;
+            if(timer_fired)
+                ++dill_timer_stats.timer_wakeups;
+        }
         /* Never retry the poll in non-blocking mode. */
         if(!block || fd_fired || timer_fired)
             break;
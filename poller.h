@@ -37,6 +37,11 @@ void dill_poller_init(void);
    it will block until there's at least one event to process. */
 void dill_wait(int block);
 
+/* Start and stop waiting for a file descriptor on behalf of the running
+   coroutine without suspending it. Used by choose(). */
+int dill_fdwait_add(int fd, int events);
+void dill_fdwait_rm(int fd, int events);
+
 /*  This function is called in the child process after the fork.
     It stops polling for the file descriptors. */
 void dill_poller_postfork(void);
@@ -0,0 +1,311 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#include "chan.h"
+#include "cr.h"
+#include "debug.h"
+#include "libdill.h"
+#include "shchan.h"
+#include "utils.h"
+
+#if !defined MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define DILL_CACHELINE 64
+
+/* The part of the channel that lives in memory shared by the processes.
+   It's a single-producer single-consumer ring: 'head' is written only by
+   the sending process, 'tail' only by the receiving one. Both are counters
+   of messages that never wrap around. The messages follow the structure. */
+struct dill_shring {
+    uint64_t head __attribute__((aligned(DILL_CACHELINE)));
+    /* Set by the receiver when it's about to block because the ring is
+       empty. */
+    int rwaiting;
+    uint64_t tail __attribute__((aligned(DILL_CACHELINE)));
+    /* Set by the sender when it's about to block because the ring is full. */
+    int swaiting;
+} __attribute__((aligned(DILL_CACHELINE)));
+
+/* A file descriptor used to wake up the peer process. With eventfd both
+   members refer to the same file descriptor, otherwise they are the two
+   ends of a pipe. */
+struct dill_shwake {
+    int rfd;
+    int wfd;
+};
+
+/* Process-local part of the channel. Both the shared mapping and
+   the file descriptors are inherited by the child created by proc(). */
+struct dill_shchan {
+    size_t sz;
+    size_t bufsz;
+    struct dill_shring *ring;
+    size_t mapsz;
+    /* Signalled when a message is written to an empty ring. */
+    struct dill_shwake items;
+    /* Signalled when a message is read from a full ring. */
+    struct dill_shwake space;
+};
+
+static const int dill_shchan_type_placeholder = 0;
+static const void *dill_shchan_type = &dill_shchan_type_placeholder;
+
+static void dill_shchan_close(int h);
+static void dill_shchan_dump(int h);
+
+static const struct hvfptrs dill_shchan_vfptrs = {
+    dill_shchan_close,
+    dill_shchan_dump
+};
+
+static int dill_shwake_init(struct dill_shwake *w) {
+#if defined HAVE_EVENTFD
+    w->rfd = eventfd(0, EFD_NONBLOCK);
+    if(dill_slow(w->rfd < 0)) return -1;
+    w->wfd = w->rfd;
+    return 0;
+#else
+    int fds[2];
+    int rc = pipe(fds);
+    if(dill_slow(rc < 0)) return -1;
+    int i;
+    for(i = 0; i != 2; ++i) {
+        int opt = fcntl(fds[i], F_GETFL, 0);
+        if(opt == -1)
+            opt = 0;
+        rc = fcntl(fds[i], F_SETFL, opt | O_NONBLOCK);
+        dill_assert(rc == 0);
+    }
+    w->rfd = fds[0];
+    w->wfd = fds[1];
+    return 0;
+#endif
+}
+
+static void dill_shwake_term(struct dill_shwake *w) {
+    fdclean(w->rfd);
+    int rc = close(w->rfd);
+    dill_assert(rc == 0);
+    if(w->wfd != w->rfd) {
+        rc = close(w->wfd);
+        dill_assert(rc == 0);
+    }
+}
+
+static void dill_shwake_signal(struct dill_shwake *w) {
+    /* If the descriptor is already signalled the write may fail with EAGAIN.
+       That's fine, the peer will wake up anyway. */
+#if defined HAVE_EVENTFD
+    uint64_t one = 1;
+    ssize_t sz = write(w->wfd, &one, sizeof(one));
+#else
+    char c = 0;
+    ssize_t sz = write(w->wfd, &c, 1);
+#endif
+    dill_assert(sz > 0 || errno == EAGAIN);
+}
+
+static void dill_shwake_drain(struct dill_shwake *w) {
+    char buf[64];
+    while(read(w->rfd, buf, sizeof(buf)) > 0) {}
+}
+
+/* Waits till the peer signals or the deadline expires. 'waiting' is
+   the flag telling the peer it should signal. If the peer's 'counter'
+   has already moved past 'value' there's no need to wait. */
+static int dill_shwake_wait(struct dill_shwake *w, int *waiting,
+      uint64_t *counter, uint64_t value, int64_t deadline) {
+    /* Announce that we are going to block, then check the counter once
+       again. Paired with the fence in dill_shwake_notify() this ensures that
+       either we see the peer's update or the peer sees the flag. */
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(counter, __ATOMIC_SEQ_CST) != value) {
+        __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    int rc = fdwait(w->rfd, FDW_IN, deadline);
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    if(dill_slow(rc < 0)) return -1;
+    dill_shwake_drain(w);
+    return 0;
+}
+
+/* Wakes up the peer if it's blocked. */
+static void dill_shwake_notify(struct dill_shwake *w, int *waiting) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(dill_slow(__atomic_load_n(waiting, __ATOMIC_RELAXED)))
+        dill_shwake_signal(w);
+}
+
+int dill_shchannel(size_t itemsz, size_t bufsz, const char *created) {
+    if(dill_slow(!bufsz || (itemsz && bufsz >
+          (SIZE_MAX - sizeof(struct dill_shring)) / itemsz))) {
+        errno = EINVAL; return -1;}
+    dill_preserve_debug();
+    struct dill_shchan *ch = malloc(sizeof(struct dill_shchan));
+    if(dill_slow(!ch)) {errno = ENOMEM; return -1;}
+    ch->sz = itemsz;
+    ch->bufsz = bufsz;
+    /* The mapping is shared with child processes created by fork(). */
+    ch->mapsz = sizeof(struct dill_shring) + itemsz * bufsz;
+    ch->ring = mmap(NULL, ch->mapsz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(dill_slow(ch->ring == MAP_FAILED)) {
+        free(ch);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(ch->ring, 0, sizeof(struct dill_shring));
+    int rc = dill_shwake_init(&ch->items);
+    if(dill_slow(rc < 0)) goto error1;
+    rc = dill_shwake_init(&ch->space);
+    if(dill_slow(rc < 0)) goto error2;
+    int h = dill_handle(dill_shchan_type, ch, &dill_shchan_vfptrs, created);
+    if(dill_slow(h < 0)) goto error3;
+    return h;
+error3:
+    dill_shwake_term(&ch->space);
+error2:
+    dill_shwake_term(&ch->items);
+error1:;
+    int err = errno;
+    rc = munmap(ch->ring, ch->mapsz);
+    dill_assert(rc == 0);
+    free(ch);
+    errno = err;
+    return -1;
+}
+
+/* Common checks done before a send or a receive. Returns 0 if the operation
+   may proceed, -1 with errno set otherwise. */
+static int dill_shchan_check(struct dill_shchan *ch, const void *val,
+      size_t len) {
+    if(dill_slow(dill_running->canceled || dill_running->stopping)) {
+        errno = ECANCELED; return -1;}
+    if(dill_slow(len != ch->sz || (len > 0 && !val))) {
+        errno = EINVAL; return -1;}
+    return 0;
+}
+
+/* Lets other coroutines run if the running one has been completing
+   operations without blocking for too long. Same as for local channels. */
+static void dill_shchan_spend(void) {
+    if(dill_slow(!dill_spend())) {
+        dill_resume(dill_running, 0);
+        dill_suspend(NULL);
+    }
+}
+
+/* Address of the slot for the message with the specified sequence number. */
+static void *dill_shchan_slot(struct dill_shchan *ch, uint64_t seq) {
+    return ((char*)(ch->ring + 1)) + (seq % ch->bufsz) * ch->sz;
+}
+
+int dill_shchan_send(int h, const void *val, size_t len, int64_t deadline) {
+    struct dill_shchan *ch = hdata(h, dill_shchan_type);
+    if(dill_slow(!ch)) return -1;
+    if(dill_slow(dill_shchan_check(ch, val, len) < 0)) return -1;
+    struct dill_shring *r = ch->ring;
+    uint64_t head = r->head;
+    while(1) {
+        uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if(dill_fast(head - tail < ch->bufsz))
+            break;
+        if(dill_slow(deadline == 0)) {
+            dill_shchan_spend();
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        int rc = dill_shwake_wait(&ch->space, &r->swaiting, &r->tail, tail,
+            deadline);
+        if(dill_slow(rc < 0)) return -1;
+        /* Another coroutine in this process may have sent in the meantime. */
+        head = r->head;
+    }
+    dill_chan_copy(dill_shchan_slot(ch, head), val, ch->sz);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    dill_shwake_notify(&ch->items, &r->rwaiting);
+    dill_shchan_spend();
+    return 0;
+}
+
+int dill_shchan_recv(int h, void *val, size_t len, int64_t deadline) {
+    struct dill_shchan *ch = hdata(h, dill_shchan_type);
+    if(dill_slow(!ch)) return -1;
+    if(dill_slow(dill_shchan_check(ch, val, len) < 0)) return -1;
+    struct dill_shring *r = ch->ring;
+    uint64_t tail = r->tail;
+    while(1) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if(dill_fast(head != tail))
+            break;
+        if(dill_slow(deadline == 0)) {
+            dill_shchan_spend();
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        int rc = dill_shwake_wait(&ch->items, &r->rwaiting, &r->head, head,
+            deadline);
+        if(dill_slow(rc < 0)) return -1;
+        tail = r->tail;
+    }
+    dill_chan_copy(val, dill_shchan_slot(ch, tail), ch->sz);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    dill_shwake_notify(&ch->space, &r->swaiting);
+    dill_shchan_spend();
+    return 0;
+}
+
+static void dill_shchan_close(int h) {
+    struct dill_shchan *ch = hdata(h, dill_shchan_type);
+    dill_assert(ch);
+    dill_shwake_term(&ch->items);
+    dill_shwake_term(&ch->space);
+    int rc = munmap(ch->ring, ch->mapsz);
+    dill_assert(rc == 0);
+    free(ch);
+}
+
+static void dill_shchan_dump(int h) {
+    struct dill_shchan *ch = hdata(h, dill_shchan_type);
+    dill_assert(ch);
+    uint64_t head = __atomic_load_n(&ch->ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&ch->ring->tail, __ATOMIC_ACQUIRE);
+    fprintf(stderr, "  SHCHANNEL item-size:%zu items:%llu/%zu\n",
+        ch->sz, (unsigned long long)(head - tail), ch->bufsz);
+}
@@ -0,0 +1,200 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "list.h"
+#include "slab.h"
+#include "utils.h"
+
+/* Size of a single chunk of memory carved into objects. Chunks are aligned
+   to their size so that the chunk an object belongs to can be found by
+   masking the object's address. */
+#define DILL_SLAB_SIZE (16 * 1024)
+
+/* Objects are allocated from size classes 64, 128, 256, 512 and 1024
+   bytes. Anything bigger goes directly to malloc(). */
+#define DILL_SLAB_MINSHIFT 6
+#define DILL_SLAB_NCLASSES 5
+#define DILL_SLAB_MAXSIZE \
+    ((size_t)1 << (DILL_SLAB_MINSHIFT + DILL_SLAB_NCLASSES - 1))
+
+/* Number of empty chunks kept around for each size class. Any chunk that
+   becomes empty beyond that is returned to the system. A few spare chunks
+   keep a channel that is repeatedly created and closed from hitting
+   malloc() every time. */
+#define DILL_SLAB_SPARE 2
+
+/* An unused object. */
+struct dill_slab_obj {
+    struct dill_slab_obj *next;
+};
+
+/* Header of a chunk. The padding keeps the objects suitably aligned. */
+union dill_slab {
+    struct {
+        /* Item in the list of chunks with unused objects. */
+        struct dill_list_item item;
+        /* Unused objects in this chunk, LIFO. */
+        struct dill_slab_obj *free;
+        /* Number of objects handed out from this chunk. */
+        size_t used;
+        /* The memory to pass to free(). */
+        void *mem;
+    } h;
+    long double align;
+};
+
+struct dill_slab_class {
+    /* Chunks that have at least one unused object. Partially used chunks
+       are at the front, empty ones at the back. */
+    struct dill_list slabs;
+    /* Number of empty chunks in the list. */
+    int spare;
+};
+
+static struct dill_slab_class dill_slab_classes[DILL_SLAB_NCLASSES];
+
+static int dill_slab_class(size_t size) {
+    int cls = 0;
+    while(size > ((size_t)1 << (DILL_SLAB_MINSHIFT + cls)))
+        ++cls;
+    return cls;
+}
+
+/* Deletes the spare chunks at exit. It is not strictly necessary but
+   valgrind will be happy about it. */
+static void dill_slab_atexit(void) {
+    int i;
+    for(i = 0; i != DILL_SLAB_NCLASSES; ++i) {
+        struct dill_slab_class *cls = &dill_slab_classes[i];
+        while(cls->spare) {
+            union dill_slab *slab = dill_cont(cls->slabs.last, union dill_slab,
+                h.item);
+            dill_list_erase(&cls->slabs, &slab->h.item);
+            free(slab->h.mem);
+            --cls->spare;
+        }
+    }
+}
+
+static union dill_slab *dill_slab_of(void *ptr) {
+    return (union dill_slab*)((uintptr_t)ptr & ~(uintptr_t)(DILL_SLAB_SIZE - 1));
+}
+
+/* Allocates a new empty chunk and splits it into objects of the size
+   class. */
+static union dill_slab *dill_slab_grow(int cls) {
+    void *mem;
+    union dill_slab *slab;
+    int rc;
+#if defined HAVE_POSIX_MEMALIGN
+    rc = posix_memalign(&mem, DILL_SLAB_SIZE, DILL_SLAB_SIZE);
+    if(dill_slow(rc != 0)) {errno = ENOMEM; return NULL;}
+    slab = mem;
+#else
+    mem = malloc(2 * DILL_SLAB_SIZE);
+    if(dill_slow(!mem)) {errno = ENOMEM; return NULL;}
+    slab = dill_slab_of((char*)mem + DILL_SLAB_SIZE - 1);
+#endif
+    static int atexit_registered = 0;
+    if(dill_slow(!atexit_registered)) {
+        rc = atexit(dill_slab_atexit);
+        dill_assert(rc == 0);
+        atexit_registered = 1;
+    }
+    slab->h.mem = mem;
+    slab->h.used = 0;
+    slab->h.free = NULL;
+    size_t objsz = (size_t)1 << (DILL_SLAB_MINSHIFT + cls);
+    char *pos = (char*)(slab + 1);
+    char *end = ((char*)slab) + DILL_SLAB_SIZE;
+    for(; pos + objsz <= end; pos += objsz) {
+        struct dill_slab_obj *obj = (struct dill_slab_obj*)pos;
+        obj->next = slab->h.free;
+        slab->h.free = obj;
+    }
+    return slab;
+}
+
+void *dill_slab_alloc(size_t size) {
+    if(dill_slow(size > DILL_SLAB_MAXSIZE)) {
+        void *ptr = malloc(size);
+        if(dill_slow(!ptr)) errno = ENOMEM;
+        return ptr;
+    }
+    struct dill_slab_class *cls = &dill_slab_classes[dill_slab_class(size)];
+    union dill_slab *slab;
+    if(dill_slow(dill_list_empty(&cls->slabs))) {
+        slab = dill_slab_grow(cls - dill_slab_classes);
+        if(dill_slow(!slab)) return NULL;
+        dill_list_insert(&cls->slabs, &slab->h.item, NULL);
+    }
+    else {
+        slab = dill_cont(dill_list_begin(&cls->slabs), union dill_slab,
+            h.item);
+        if(dill_slow(!slab->h.used)) --cls->spare;
+    }
+    struct dill_slab_obj *obj = slab->h.free;
+    slab->h.free = obj->next;
+    ++slab->h.used;
+    /* The chunk is full. It's put back into the list once an object is
+       returned to it. */
+    if(dill_slow(!slab->h.free)) dill_list_erase(&cls->slabs, &slab->h.item);
+    return obj;
+}
+
+void dill_slab_free(void *ptr, size_t size) {
+    if(dill_slow(size > DILL_SLAB_MAXSIZE)) {
+        free(ptr);
+        return;
+    }
+    struct dill_slab_class *cls = &dill_slab_classes[dill_slab_class(size)];
+    union dill_slab *slab = dill_slab_of(ptr);
+    /* LIFO order means the object we hand out next is likely to be hot
+       in the cache. */
+    struct dill_slab_obj *obj = (struct dill_slab_obj*)ptr;
+    if(dill_slow(!slab->h.free))
+        dill_list_insert(&cls->slabs, &slab->h.item,
+            dill_list_begin(&cls->slabs));
+    obj->next = slab->h.free;
+    slab->h.free = obj;
+    --slab->h.used;
+    if(dill_fast(slab->h.used)) return;
+    /* The chunk is empty. Either keep it as a spare at the back of the list
+       or return it to the system. */
+    if(dill_slow(cls->spare >= DILL_SLAB_SPARE)) {
+        dill_list_erase(&cls->slabs, &slab->h.item);
+        free(slab->h.mem);
+        return;
+    }
+    if(dill_slow(dill_list_next(&slab->h.item))) {
+        dill_list_erase(&cls->slabs, &slab->h.item);
+        dill_list_insert(&cls->slabs, &slab->h.item, NULL);
+    }
+    ++cls->spare;
+}
@@ -0,0 +1,356 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cr.h"
+#include "debug.h"
+#include "libdill.h"
+#include "list.h"
+#include "slab.h"
+#include "timer.h"
+#include "utils.h"
+
+/* Per-coroutine data. Used to store info while the coroutine is blocked
+   on a mutex, a semaphore or a condition variable. */
+struct dill_syncdata {
+    /* Member of the list of coroutines waiting for the object. */
+    struct dill_list_item item;
+    /* The list the coroutine is waiting in. */
+    struct dill_list *waiters;
+    /* Deadline of the operation. -1 if none. */
+    int64_t ddline;
+};
+
+DILL_CT_ASSERT(sizeof(struct dill_syncdata) <= DILL_OPAQUE_SIZE);
+
+struct dill_mutex {
+    /* The coroutine holding the lock. NULL if the mutex is unlocked. */
+    struct dill_cr *owner;
+    /* Coroutines waiting for the lock, in the order of arrival. */
+    struct dill_list waiters;
+};
+
+struct dill_sem {
+    int value;
+    struct dill_list waiters;
+};
+
+struct dill_cond {
+    struct dill_list waiters;
+};
+
+static const int dill_mutex_type_placeholder = 0;
+static const void *dill_mutex_type = &dill_mutex_type_placeholder;
+static void dill_mutex_close(int h);
+static void dill_mutex_dump(int h);
+static const struct hvfptrs dill_mutex_vfptrs = {
+    dill_mutex_close,
+    dill_mutex_dump
+};
+
+static const int dill_sem_type_placeholder = 0;
+static const void *dill_sem_type = &dill_sem_type_placeholder;
+static void dill_sem_close(int h);
+static void dill_sem_dump(int h);
+static const struct hvfptrs dill_sem_vfptrs = {
+    dill_sem_close,
+    dill_sem_dump
+};
+
+static const int dill_cond_type_placeholder = 0;
+static const void *dill_cond_type = &dill_cond_type_placeholder;
+static void dill_cond_close(int h);
+static void dill_cond_dump(int h);
+static const struct hvfptrs dill_cond_vfptrs = {
+    dill_cond_close,
+    dill_cond_dump
+};
+
+/******************************************************************************/
+/*  Waiting                                                                   */
+/******************************************************************************/
+
+static void dill_sync_unblock_cb(struct dill_cr *cr) {
+    struct dill_syncdata *sd = (struct dill_syncdata*)cr->opaque;
+    /* If woken up by the timer or by cancellation, stop waiting. When
+       woken up by the object itself the coroutine was already removed
+       from the list. */
+    if(dill_list_item_inlist(&sd->item))
+        dill_list_erase(sd->waiters, &sd->item);
+    if(sd->ddline >= 0)
+        dill_timer_rm(&cr->timer);
+}
+
+/* Blocks the running coroutine till it's woken up by dill_sync_wake().
+   Cancellation is checked by the caller. If 'scoped' is zero the deadline
+   scope of the coroutine doesn't apply, which is what internal waits that
+   must not fail need. */
+static int dill_sync_wait(struct dill_list *waiters, int64_t deadline,
+      int scoped) {
+    struct dill_syncdata *sd = (struct dill_syncdata*)dill_running->opaque;
+    sd->waiters = waiters;
+    deadline = dill_ms2us(deadline);
+    if(scoped) deadline = dill_ddline(deadline);
+    sd->ddline = deadline;
+    dill_list_insert(waiters, &sd->item, NULL);
+    if(deadline >= 0)
+        dill_timer_add_us(&dill_running->timer, deadline);
+    int rc = dill_suspend(dill_sync_unblock_cb);
+    if(dill_slow(rc < 0)) {errno = -rc; return -1;}
+    return 0;
+}
+
+/* Removes the first waiter from the list and resumes it. Returns the
+   coroutine or NULL if there was no waiter. */
+static struct dill_cr *dill_sync_wake(struct dill_list *waiters, int result) {
+    if(dill_list_empty(waiters))
+        return NULL;
+    struct dill_list_item *it = dill_list_begin(waiters);
+    dill_list_erase(waiters, it);
+    uint8_t *opaque = (uint8_t*)dill_cont(it, struct dill_syncdata, item);
+    struct dill_cr *cr = dill_cont(opaque, struct dill_cr, opaque);
+    dill_resume(cr, result);
+    return cr;
+}
+
+static int dill_sync_count(struct dill_list *waiters) {
+    int n = 0;
+    struct dill_list_item *it;
+    for(it = dill_list_begin(waiters); it; it = dill_list_next(it))
+        ++n;
+    return n;
+}
+
+/* Common checks done before blocking. Returns 0 if the caller may block,
+   -1 with errno set otherwise. */
+static int dill_sync_check(int64_t deadline) {
+    if(dill_slow(dill_running->canceled || dill_running->stopping)) {
+        errno = ECANCELED; return -1;}
+    if(dill_slow(deadline == 0)) {errno = ETIMEDOUT; return -1;}
+    return 0;
+}
+
+/******************************************************************************/
+/*  Mutex                                                                     */
+/******************************************************************************/
+
+int dill_mutex(const char *created) {
+    struct dill_mutex *m = dill_slab_alloc(sizeof(struct dill_mutex));
+    if(dill_slow(!m)) return -1;
+    m->owner = NULL;
+    dill_list_init(&m->waiters);
+    int h = dill_handle(dill_mutex_type, m, &dill_mutex_vfptrs, created);
+    if(dill_slow(h < 0)) {
+        int err = errno;
+        dill_slab_free(m, sizeof(struct dill_mutex));
+        errno = err;
+        return -1;
+    }
+    return h;
+}
+
+/* Acquires the lock, ignoring cancellation. Used by condwait() which has
+   to return with the lock held. Fails only if the mutex is closed. */
+static int dill_mutex_relock(struct dill_mutex *m) {
+    /* The unlocking coroutine hands the lock over directly. However, if the
+       wait was interrupted, e.g. by cancellation, the coroutine is no longer
+       among the waiters and the lock may have been released meanwhile. */
+    while(m->owner != dill_running) {
+        if(!m->owner) {
+            m->owner = dill_running;
+            break;
+        }
+        int rc = dill_sync_wait(&m->waiters, -1, 0);
+        if(dill_slow(rc < 0 && errno == EBADF)) return -1;
+    }
+    return 0;
+}
+
+int dill_mutexlock(int h, int64_t deadline, const char *current) {
+    struct dill_mutex *m = hdata(h, dill_mutex_type);
+    if(dill_slow(!m)) return -1;
+    if(dill_fast(!m->owner)) {
+        m->owner = dill_running;
+        return 0;
+    }
+    if(dill_slow(m->owner == dill_running)) {errno = EDEADLK; return -1;}
+    if(dill_slow(dill_sync_check(deadline) < 0)) return -1;
+    /* When woken up without an error the lock is already ours. */
+    if(dill_slow(dill_sync_wait(&m->waiters, deadline, 1) < 0)) return -1;
+    dill_assert(m->owner == dill_running);
+    return 0;
+}
+
+static void dill_mutex_unlock(struct dill_mutex *m) {
+    /* Hand the lock over to the first waiter, if any. That way a coroutine
+       that unlocks and immediately locks again can't starve the others. */
+    m->owner = dill_sync_wake(&m->waiters, 0);
+}
+
+int dill_mutexunlock(int h, const char *current) {
+    struct dill_mutex *m = hdata(h, dill_mutex_type);
+    if(dill_slow(!m)) return -1;
+    if(dill_slow(m->owner != dill_running)) {errno = EPERM; return -1;}
+    dill_mutex_unlock(m);
+    return 0;
+}
+
+static void dill_mutex_close(int h) {
+    struct dill_mutex *m = hdata(h, dill_mutex_type);
+    dill_assert(m);
+    while(dill_sync_wake(&m->waiters, -EBADF)) {}
+    dill_slab_free(m, sizeof(struct dill_mutex));
+}
+
+static void dill_mutex_dump(int h) {
+    struct dill_mutex *m = hdata(h, dill_mutex_type);
+    dill_assert(m);
+    fprintf(stderr, "  MUTEX locked:%d waiters:%d\n", m->owner ? 1 : 0,
+        dill_sync_count(&m->waiters));
+}
+
+/******************************************************************************/
+/*  Semaphore                                                                 */
+/******************************************************************************/
+
+int dill_semaphore(int value, const char *created) {
+    if(dill_slow(value < 0)) {errno = EINVAL; return -1;}
+    struct dill_sem *s = dill_slab_alloc(sizeof(struct dill_sem));
+    if(dill_slow(!s)) return -1;
+    s->value = value;
+    dill_list_init(&s->waiters);
+    int h = dill_handle(dill_sem_type, s, &dill_sem_vfptrs, created);
+    if(dill_slow(h < 0)) {
+        int err = errno;
+        dill_slab_free(s, sizeof(struct dill_sem));
+        errno = err;
+        return -1;
+    }
+    return h;
+}
+
+int dill_semacquire(int h, int64_t deadline, const char *current) {
+    struct dill_sem *s = hdata(h, dill_sem_type);
+    if(dill_slow(!s)) return -1;
+    if(dill_fast(s->value > 0)) {
+        --s->value;
+        return 0;
+    }
+    if(dill_slow(dill_sync_check(deadline) < 0)) return -1;
+    /* When woken up without an error the unit was handed over to us. */
+    return dill_sync_wait(&s->waiters, deadline, 1);
+}
+
+int dill_semrelease(int h, const char *current) {
+    struct dill_sem *s = hdata(h, dill_sem_type);
+    if(dill_slow(!s)) return -1;
+    if(dill_sync_wake(&s->waiters, 0))
+        return 0;
+    if(dill_slow(s->value == INT_MAX)) {errno = EOVERFLOW; return -1;}
+    ++s->value;
+    return 0;
+}
+
+static void dill_sem_close(int h) {
+    struct dill_sem *s = hdata(h, dill_sem_type);
+    dill_assert(s);
+    while(dill_sync_wake(&s->waiters, -EBADF)) {}
+    dill_slab_free(s, sizeof(struct dill_sem));
+}
+
+static void dill_sem_dump(int h) {
+    struct dill_sem *s = hdata(h, dill_sem_type);
+    dill_assert(s);
+    fprintf(stderr, "  SEMAPHORE value:%d waiters:%d\n", s->value,
+        dill_sync_count(&s->waiters));
+}
+
+/******************************************************************************/
+/*  Condition variable                                                        */
+/******************************************************************************/
+
+int dill_condvar(const char *created) {
+    struct dill_cond *cv = dill_slab_alloc(sizeof(struct dill_cond));
+    if(dill_slow(!cv)) return -1;
+    dill_list_init(&cv->waiters);
+    int h = dill_handle(dill_cond_type, cv, &dill_cond_vfptrs, created);
+    if(dill_slow(h < 0)) {
+        int err = errno;
+        dill_slab_free(cv, sizeof(struct dill_cond));
+        errno = err;
+        return -1;
+    }
+    return h;
+}
+
+int dill_condwait(int h, int mutex, int64_t deadline, const char *current) {
+    struct dill_cond *cv = hdata(h, dill_cond_type);
+    if(dill_slow(!cv)) return -1;
+    struct dill_mutex *m = hdata(mutex, dill_mutex_type);
+    if(dill_slow(!m)) return -1;
+    if(dill_slow(m->owner != dill_running)) {errno = EPERM; return -1;}
+    if(dill_slow(dill_sync_check(deadline) < 0)) return -1;
+    dill_mutex_unlock(m);
+    int rc = dill_sync_wait(&cv->waiters, deadline, 1);
+    int err = errno;
+    /* The mutex may have been closed in the meantime. */
+    m = hdata(mutex, dill_mutex_type);
+    if(dill_slow(!m)) {errno = EBADF; return -1;}
+    /* Whatever happened, return with the mutex locked. */
+    if(dill_slow(dill_mutex_relock(m) < 0)) return -1;
+    errno = err;
+    return rc;
+}
+
+int dill_condsignal(int h, const char *current) {
+    struct dill_cond *cv = hdata(h, dill_cond_type);
+    if(dill_slow(!cv)) return -1;
+    dill_sync_wake(&cv->waiters, 0);
+    return 0;
+}
+
+int dill_condbroadcast(int h, const char *current) {
+    struct dill_cond *cv = hdata(h, dill_cond_type);
+    if(dill_slow(!cv)) return -1;
+    while(dill_sync_wake(&cv->waiters, 0)) {}
+    return 0;
+}
+
+static void dill_cond_close(int h) {
+    struct dill_cond *cv = hdata(h, dill_cond_type);
+    dill_assert(cv);
+    while(dill_sync_wake(&cv->waiters, -EBADF)) {}
+    dill_slab_free(cv, sizeof(struct dill_cond));
+}
+
+static void dill_cond_dump(int h) {
+    struct dill_cond *cv = hdata(h, dill_cond_type);
+    dill_assert(cv);
+    fprintf(stderr, "  CONDVAR waiters:%d\n", dill_sync_count(&cv->waiters));
+}
+
@@ -35,6 +35,8 @@ struct foo {
     int second;
 };
 
+CHTYPE(foo, struct foo)
+
 coroutine void sender(int ch, int doyield, int val) {
     if(doyield) {
         int rc = yield();
@@ -44,6 +46,19 @@ coroutine void sender(int ch, int doyield, int val) {
     assert(rc == 0);
 }
 
+coroutine void delayedsender(int ch, int val) {
+    int rc = msleep(now() + 30);
+    assert(rc == 0);
+    rc = chsend(ch, &val, sizeof(val), -1);
+    assert(rc == 0);
+}
+
+static int flag = 0;
+
+coroutine void setflag(void) {
+    flag = 1;
+}
+
 coroutine void receiver(int ch, int expected) {
     int val;
     int rc = chrecv(ch, &val, sizeof(val), -1);
@@ -398,6 +413,217 @@ int main() {
     rc = chrecv(ch20, NULL, 0, now() + 10);
     assert(rc == -1 && errno == ETIMEDOUT);
     hclose(ch20);
+
+    /* Unbounded channel spanning multiple segments. */
+    int ch21 = uchannel(sizeof(int), 0);
+    assert(ch21 >= 0);
+    for(i = 0; i != 10000; ++i) {
+        rc = chsend(ch21, &i, sizeof(i), 0);
+        assert(rc == 0);
+    }
+    for(i = 0; i != 10000; ++i) {
+        rc = chrecv(ch21, &val, sizeof(val), -1);
+        assert(rc == 0);
+        assert(val == i);
+    }
+    rc = chrecv(ch21, &val, sizeof(val), 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    /* Interleaved sends and receives keep the order. */
+    for(i = 0; i != 5000; ++i) {
+        rc = chsend(ch21, &i, sizeof(i), 0);
+        assert(rc == 0);
+        if(i % 3 == 0) {
+            rc = chrecv(ch21, &val, sizeof(val), -1);
+            assert(rc == 0);
+            assert(val == i / 3);
+        }
+    }
+    /* Closing a channel with messages in flight releases them. */
+    hclose(ch21);
+
+    /* Soft limit on an unbounded channel applies backpressure. */
+    int ch22 = uchannel(sizeof(int), 2);
+    assert(ch22 >= 0);
+    val = 1;
+    rc = chsend(ch22, &val, sizeof(val), -1);
+    assert(rc == 0);
+    val = 2;
+    rc = chsend(ch22, &val, sizeof(val), -1);
+    assert(rc == 0);
+    rc = chsend(ch22, &val, sizeof(val), 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    int hndl13 = go(sender(ch22, 0, 3));
+    assert(hndl13 >= 0);
+    for(i = 1; i != 4; ++i) {
+        rc = chrecv(ch22, &val, sizeof(val), -1);
+        assert(rc == 0);
+        assert(val == i);
+    }
+    rc = chdone(ch22);
+    assert(rc == 0);
+    rc = chrecv(ch22, &val, sizeof(val), -1);
+    assert(rc == -1 && errno == EPIPE);
+    hclose(ch22);
+    rc = hclose(hndl13);
+    assert(rc == 0);
+
+    /* Test channel statistics. */
+    dochstats(1);
+    int ch23 = channel(sizeof(int), 4);
+    assert(ch23 >= 0);
+    struct chstats st;
+    rc = chstats(ch23, &st);
+    assert(rc == 0);
+    assert(st.sent == 0 && st.received == 0 && st.hwm == 0);
+    for(i = 0; i != 3; ++i) {
+        rc = chsend(ch23, &i, sizeof(i), -1);
+        assert(rc == 0);
+    }
+    for(i = 0; i != 3; ++i) {
+        rc = chrecv(ch23, &val, sizeof(val), -1);
+        assert(rc == 0);
+    }
+    int hndl14 = go(delayedsender(ch23, 77));
+    assert(hndl14 >= 0);
+    rc = chrecv(ch23, &val, sizeof(val), -1);
+    assert(rc == 0 && val == 77);
+    rc = chstats(ch23, &st);
+    assert(rc == 0);
+    assert(st.sent == 4 && st.received == 4);
+    assert(st.hwm == 3);
+    assert(st.send_blocked == 0);
+    assert(st.recv_blocked >= 20);
+    assert(st.occupancy[0] == 2);
+    assert(st.occupancy[1] == 2);
+    assert(st.occupancy[2] == 3);
+    rc = chstats(hndl14, &st);
+    assert(rc == -1 && errno == ENOTSUP);
+    rc = hclose(hndl14);
+    assert(rc == 0);
+    hclose(ch23);
+    dochstats(0);
+
+    /* Operations that don't block still let other coroutines run
+       once in a while. */
+    int ch24 = channel(sizeof(int), 1);
+    assert(ch24 >= 0);
+    int hndl15 = go(setflag());
+    assert(hndl15 >= 0);
+    while(!flag) {
+        rc = chrecv(ch24, &val, sizeof(val), 0);
+        assert(rc == -1 && errno == ETIMEDOUT);
+    }
+    rc = hclose(hndl15);
+    assert(rc == 0);
+    flag = 0;
+    hndl15 = go(setflag());
+    assert(hndl15 >= 0);
+    while(!flag) {
+        rc = chsend(ch24, &val, sizeof(val), -1);
+        assert(rc == 0);
+        rc = chrecv(ch24, &val, sizeof(val), -1);
+        assert(rc == 0);
+    }
+    rc = hclose(hndl15);
+    assert(rc == 0);
+    hclose(ch24);
+
+    /* Test typed channels. */
+    int ch25 = foo_channel(2);
+    assert(ch25 >= 0);
+    foo1.first = 5;
+    foo1.second = 6;
+    rc = foo_send(ch25, foo1, -1);
+    assert(rc == 0);
+    rc = foo_recv(ch25, &foo2, -1);
+    assert(rc == 0);
+    assert(foo2.first == 5 && foo2.second == 6);
+    rc = foo_recv(ch25, &foo2, 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = chrecv(ch25, &val, sizeof(val), 0);
+    assert(rc == -1 && errno == EINVAL);
+    hclose(ch25);
+
+    /* Test overflow policies. */
+    int ch26 = channel(sizeof(int), 3);
+    assert(ch26 >= 0);
+    rc = chpolicy(ch26, 7);
+    assert(rc == -1 && errno == EINVAL);
+    rc = chpolicy(ch26, CHOVERWRITE);
+    assert(rc == 0);
+    for(i = 0; i != 5; ++i) {
+        rc = chsend(ch26, &i, sizeof(i), 0);
+        assert(rc == 0);
+    }
+    for(i = 2; i != 5; ++i) {
+        rc = chrecv(ch26, &val, sizeof(val), 0);
+        assert(rc == 0 && val == i);
+    }
+    rc = chpolicy(ch26, CHDROP);
+    assert(rc == 0);
+    for(i = 0; i != 5; ++i) {
+        rc = chsend(ch26, &i, sizeof(i), 0);
+        assert(rc == 0);
+    }
+    for(i = 0; i != 3; ++i) {
+        rc = chrecv(ch26, &val, sizeof(val), 0);
+        assert(rc == 0 && val == i);
+    }
+    rc = chstats(ch26, &st);
+    assert(rc == 0 && st.dropped == 4);
+    /* Switching policy releases a blocked sender. */
+    rc = chpolicy(ch26, CHBLOCK);
+    assert(rc == 0);
+    for(i = 0; i != 3; ++i) {
+        rc = chsend(ch26, &i, sizeof(i), 0);
+        assert(rc == 0);
+    }
+    int hndl16 = go(sender(ch26, 0, 3));
+    assert(hndl16 >= 0);
+    rc = yield();
+    assert(rc == 0);
+    rc = chpolicy(ch26, CHOVERWRITE);
+    assert(rc == 0);
+    for(i = 1; i != 4; ++i) {
+        rc = chrecv(ch26, &val, sizeof(val), 0);
+        assert(rc == 0 && val == i);
+    }
+    rc = hclose(hndl16);
+    assert(rc == 0);
+    hclose(ch26);
+    int ch27 = channel(sizeof(int), 0);
+    assert(ch27 >= 0);
+    rc = chpolicy(ch27, CHDROP);
+    assert(rc == -1 && errno == EINVAL);
+    hclose(ch27);
+
+    /* Channels spread over many slabs, half of them closed, the rest still
+       usable, then all of them allocated again. */
+    int chs[1000];
+    for(i = 0; i != 1000; ++i) {
+        chs[i] = channel(sizeof(int), 4);
+        assert(chs[i] >= 0);
+        rc = chsend(chs[i], &i, sizeof(i), 0);
+        assert(rc == 0);
+    }
+    for(i = 0; i < 1000; i += 2) {
+        rc = hclose(chs[i]);
+        assert(rc == 0);
+    }
+    for(i = 1; i < 1000; i += 2) {
+        rc = chrecv(chs[i], &val, sizeof(val), 0);
+        assert(rc == 0 && val == i);
+        rc = hclose(chs[i]);
+        assert(rc == 0);
+    }
+    for(i = 0; i != 1000; ++i) {
+        chs[i] = channel(sizeof(int), 4);
+        assert(chs[i] >= 0);
+    }
+    for(i = 0; i != 1000; ++i) {
+        rc = hclose(chs[i]);
+        assert(rc == 0);
+    }
     return 0;
 }
 
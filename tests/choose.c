@@ -24,6 +24,8 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
 #include "../libdill.h"
 
@@ -79,6 +81,36 @@ coroutine void feeder(int ch, int val) {
     }
 }
 
+coroutine void fdtrigger(int fd, int64_t deadline) {
+    int rc = msleep(deadline);
+    assert(rc == 0);
+    ssize_t sz = send(fd, "A", 1, 0);
+    assert(sz == 1);
+}
+
+coroutine void wmdrain(int ch, int n) {
+    int i;
+    for(i = 0; i != n; ++i) {
+        int val;
+        int rc = chrecv(ch, &val, sizeof(val), -1);
+        assert(rc == 0);
+    }
+}
+
+coroutine void wmfill(int ch, int n) {
+    int i;
+    for(i = 0; i != n; ++i) {
+        int rc = chsend(ch, &i, sizeof(i), -1);
+        assert(rc == 0);
+    }
+}
+
+coroutine void wmwaiter(int ch, int op, int err) {
+    struct chclause cl = {ch, op, NULL, 0};
+    int rc = choose(&cl, 1, now() + 1000);
+    assert(rc == 0 && errno == err);
+}
+
 struct large {
     char buf[1024];
 };
@@ -357,6 +389,207 @@ int main() {
     rc = hclose(hndl11);
     assert(rc == 0);
 
+    /* Test file descriptor clause firing before the channel clause. */
+    int fds[2];
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    assert(rc == 0);
+    int ch23 = channel(sizeof(int), 0);
+    assert(ch23 >= 0);
+    int events = 0;
+    struct chclause cls19[] = {
+        {ch23, CHRECV, &val, sizeof(val)},
+        {fds[0], CHFDIN, &events, sizeof(events)}
+    };
+    start = now();
+    int hndl12 = go(fdtrigger(fds[1], start + 50));
+    assert(hndl12 >= 0);
+    rc = choose(cls19, 2, start + 1000);
+    assert(rc == 1 && errno == 0);
+    assert(events == FDW_IN);
+    diff = now() - start;
+    assert(diff > 30 && diff < 70);
+    rc = hclose(hndl12);
+    assert(rc == 0);
+    char c;
+    ssize_t sz = recv(fds[0], &c, 1, 0);
+    assert(sz == 1);
+
+    /* Test channel clause firing before the file descriptor clause.
+       The file descriptor must not stay in the pollset. */
+    int hndl13 = go(sender3(ch23, 5555, now() + 20));
+    assert(hndl13 >= 0);
+    rc = choose(cls19, 2, -1);
+    assert(rc == 0 && errno == 0);
+    assert(val == 5555);
+    rc = hclose(hndl13);
+    assert(rc == 0);
+    rc = fdwait(fds[0], FDW_IN, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+
+    /* Test non-blocking choose with a ready file descriptor. */
+    struct chclause cls20[] = {
+        {ch23, CHRECV, &val, sizeof(val)},
+        {fds[0], CHFDOUT, NULL, 0}
+    };
+    rc = choose(cls20, 2, 0);
+    assert(rc == 1 && errno == 0);
+    struct chclause cls21[] = {
+        {ch23, CHRECV, &val, sizeof(val)},
+        {fds[0], CHFDIN, NULL, 0}
+    };
+    rc = choose(cls21, 2, 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    hclose(ch23);
+    fdclean(fds[0]);
+    rc = close(fds[0]);
+    assert(rc == 0);
+    fdclean(fds[1]);
+    rc = close(fds[1]);
+    assert(rc == 0);
+
+    /* Test choosing available clauses in order. */
+    int ch24 = channel(sizeof(int), 100);
+    assert(ch24 >= 0);
+    int ch25 = channel(sizeof(int), 100);
+    assert(ch25 >= 0);
+    for(i = 0; i != 100; ++i) {
+        rc = chsend(ch24, &i, sizeof(i), -1);
+        assert(rc == 0);
+        rc = chsend(ch25, &i, sizeof(i), -1);
+        assert(rc == 0);
+    }
+    struct chclause cls22[] = {
+        {ch25, CHRECV, &val, sizeof(val)},
+        {ch24, CHRECV, &val, sizeof(val)}
+    };
+    for(i = 0; i != 100; ++i) {
+        rc = choosefirst(cls22, 2, -1);
+        assert(rc == 0 && errno == 0);
+        assert(val == i);
+    }
+    rc = choosefirst(cls22, 2, 0);
+    assert(rc == 1 && errno == 0);
+    assert(val == 0);
+
+    /* Test weighted choice. */
+    int ch26 = channel(sizeof(int), 0);
+    assert(ch26 >= 0);
+    struct chclause cls23[] = {
+        {ch26, CHRECV, &val, sizeof(val)},
+        {ch24, CHRECV, &val, sizeof(val)},
+        {ch25, CHSEND, &val, sizeof(val)}
+    };
+    int weights1[] = {100, 0, 1};
+    for(i = 0; i != 50; ++i) {
+        rc = chooseweighted(cls23, 3, weights1, -1);
+        assert(rc == 2 && errno == 0);
+    }
+    int weights2[] = {0, 1, 3};
+    int counts[3] = {0, 0, 0};
+    for(i = 0; i != 4000; ++i) {
+        rc = chooseweighted(cls23, 3, weights2, -1);
+        assert(rc >= 1 && errno == 0);
+        ++counts[rc];
+        /* Keep both channels half-full. */
+        if(rc == 1)
+            rc = chsend(ch24, &val, sizeof(val), -1);
+        else
+            rc = chrecv(ch25, &val, sizeof(val), -1);
+        assert(rc == 0);
+    }
+    assert(counts[0] == 0);
+    assert(counts[2] > 2700 && counts[2] < 3300);
+    int weights3[] = {1, -1, 1};
+    rc = chooseweighted(cls23, 3, weights3, -1);
+    assert(rc == -1 && errno == EINVAL);
+    rc = chooseweighted(cls23, 3, NULL, -1);
+    assert(rc == -1 && errno == EINVAL);
+    hclose(ch26);
+    hclose(ch25);
+    hclose(ch24);
+
+    /* Watermark clauses. */
+    int ch27 = channel(sizeof(int), 10);
+    assert(ch27 >= 0);
+    struct chclause cls24[] = {{ch27, CHHIGH, NULL, 0}};
+    struct chclause cls25[] = {{ch27, CHLOW, NULL, 0}};
+    rc = choose(cls24, 1, 0);
+    assert(rc == -1 && errno == EINVAL);
+    rc = choose(cls25, 1, 0);
+    assert(rc == -1 && errno == EINVAL);
+    rc = chwatermarks(ch27, 2, 2);
+    assert(rc == -1 && errno == EINVAL);
+    rc = chwatermarks(ch27, 11, 2);
+    assert(rc == -1 && errno == EINVAL);
+    rc = chwatermarks(ch27, 8, 2);
+    assert(rc == 0);
+    rc = choose(cls24, 1, 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = choose(cls25, 1, 0);
+    assert(rc == 0 && errno == 0);
+    struct chclause cls26[] = {{ch27, CHHIGH, &val, sizeof(val)}};
+    rc = choose(cls26, 1, 0);
+    assert(rc == -1 && errno == EINVAL);
+    /* Crossing the high watermark wakes the waiter up. */
+    go(wmfill(ch27, 8));
+    rc = choose(cls24, 1, -1);
+    assert(rc == 0 && errno == 0);
+    rc = choose(cls25, 1, 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    /* Going below the high watermark doesn't relieve the channel. */
+    rc = chrecv(ch27, &val, sizeof(val), -1);
+    assert(rc == 0 && val == 0);
+    rc = choose(cls24, 1, 0);
+    assert(rc == 0 && errno == 0);
+    /* Dropping to the low watermark does. */
+    go(wmdrain(ch27, 5));
+    rc = choose(cls25, 1, -1);
+    assert(rc == 0 && errno == 0);
+    rc = chrecv(ch27, &val, sizeof(val), 0);
+    assert(rc == 0 && val == 6);
+    rc = chrecv(ch27, &val, sizeof(val), 0);
+    assert(rc == 0 && val == 7);
+    rc = chrecv(ch27, &val, sizeof(val), 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    /* Lowering the watermarks applies them to the current content. */
+    go(wmfill(ch27, 3));
+    rc = msleep(now() + 10);
+    assert(rc == 0);
+    rc = chwatermarks(ch27, 3, 1);
+    assert(rc == 0);
+    rc = choose(cls24, 1, 0);
+    assert(rc == 0 && errno == 0);
+    /* Switching the watermarks off fails the clauses waiting for
+       congestion. */
+    go(wmdrain(ch27, 2));
+    rc = choose(cls25, 1, -1);
+    assert(rc == 0 && errno == 0);
+    int wm = go(wmwaiter(ch27, CHHIGH, EINVAL));
+    assert(wm >= 0);
+    rc = chwatermarks(ch27, 0, 0);
+    assert(rc == 0);
+    rc = cojoin(wm, NULL, -1);
+    assert(rc == 0);
+    rc = choose(cls25, 1, 0);
+    assert(rc == -1 && errno == EINVAL);
+    hclose(ch27);
+
+    /* chdone() resumes the watermark clauses. */
+    int ch28 = channel(sizeof(int), 10);
+    assert(ch28 >= 0);
+    rc = chwatermarks(ch28, 2, 1);
+    assert(rc == 0);
+    wm = go(wmwaiter(ch28, CHHIGH, EPIPE));
+    assert(wm >= 0);
+    rc = chdone(ch28);
+    assert(rc == 0);
+    rc = cojoin(wm, NULL, -1);
+    assert(rc == 0);
+    struct chclause cls27[] = {{ch28, CHLOW, NULL, 0}};
+    rc = choose(cls27, 1, 0);
+    assert(rc == 0 && errno == EPIPE);
+    hclose(ch28);
+
     return 0;
 }
 
@@ -0,0 +1,175 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+#include <assert.h>
+#include <stdio.h>
+
+#include "../libdill.h"
+
+coroutine void sender(int ch, int val) {
+    int rc = chsend(ch, &val, sizeof(val), -1);
+    assert(rc == 0);
+}
+
+coroutine void receiver(int ch, int expected) {
+    int val;
+    int rc = chrecv(ch, &val, sizeof(val), -1);
+    assert(rc == 0);
+    assert(val == expected);
+}
+
+coroutine void selsender(int ch, int val) {
+    struct chclause cl = {ch, CHSEND, &val, sizeof(val)};
+    int sel = chselector(&cl, 1);
+    assert(sel >= 0);
+    int rc = chselect(sel, -1);
+    assert(rc == 0 && errno == 0);
+    rc = hclose(sel);
+    assert(rc == 0);
+}
+
+int main() {
+    int rc;
+    int val;
+
+    /* Receive from whichever of the buffered channels has a message. */
+    int ch[3];
+    int i;
+    for(i = 0; i != 3; ++i) {
+        ch[i] = channel(sizeof(int), 10);
+        assert(ch[i] >= 0);
+    }
+    struct chclause cls1[] = {
+        {ch[0], CHRECV, &val, sizeof(val)},
+        {ch[1], CHRECV, &val, sizeof(val)},
+        {ch[2], CHRECV, &val, sizeof(val)}
+    };
+    int sel1 = chselector(cls1, 3);
+    assert(sel1 >= 0);
+    rc = chselect(sel1, 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    for(i = 0; i != 1000; ++i) {
+        int v = i;
+        rc = chsend(ch[i % 3], &v, sizeof(v), -1);
+        assert(rc == 0);
+        rc = chselect(sel1, -1);
+        assert(rc == i % 3 && errno == 0);
+        assert(val == i);
+    }
+    rc = chselect(sel1, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+
+    /* Block on the selector till a sender shows up. */
+    int ch4 = channel(sizeof(int), 0);
+    assert(ch4 >= 0);
+    struct chclause cls2[] = {
+        {ch[0], CHRECV, &val, sizeof(val)},
+        {ch4, CHRECV, &val, sizeof(val)}
+    };
+    int sel2 = chselector(cls2, 2);
+    assert(sel2 >= 0);
+    int hndl1 = go(sender(ch4, 333));
+    assert(hndl1 >= 0);
+    rc = chselect(sel2, -1);
+    assert(rc == 1 && errno == 0);
+    assert(val == 333);
+    rc = hclose(hndl1);
+    assert(rc == 0);
+    /* The selector is blocked when the sender arrives. */
+    hndl1 = go(sender(ch4, 444));
+    assert(hndl1 >= 0);
+    rc = msleep(now() + 10);
+    assert(rc == 0);
+    rc = chselect(sel2, -1);
+    assert(rc == 1 && errno == 0);
+    assert(val == 444);
+    rc = hclose(hndl1);
+    assert(rc == 0);
+
+    /* Send via selector to a blocked receiver. */
+    int hndl2 = go(receiver(ch4, 555));
+    assert(hndl2 >= 0);
+    int out = 555;
+    struct chclause cls3[] = {{ch4, CHSEND, &out, sizeof(out)}};
+    int sel3 = chselector(cls3, 1);
+    assert(sel3 >= 0);
+    rc = chselect(sel3, -1);
+    assert(rc == 0 && errno == 0);
+    rc = hclose(hndl2);
+    assert(rc == 0);
+
+    /* Two selectors meet on an unbuffered channel. */
+    int hndl3 = go(selsender(ch4, 666));
+    assert(hndl3 >= 0);
+    rc = chselect(sel2, -1);
+    assert(rc == 1 && errno == 0);
+    assert(val == 666);
+    rc = hclose(hndl3);
+    assert(rc == 0);
+    rc = chselect(sel2, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    hndl3 = go(selsender(ch4, 777));
+    assert(hndl3 >= 0);
+    rc = chselect(sel2, -1);
+    assert(rc == 1 && errno == 0);
+    assert(val == 777);
+    rc = hclose(hndl3);
+    assert(rc == 0);
+
+    /* Done-with channel reports EPIPE for the triggered clause. */
+    rc = chdone(ch4);
+    assert(rc == 0);
+    rc = chselect(sel2, -1);
+    assert(rc == 1 && errno == EPIPE);
+
+    /* Closing the channel while the selector is blocked. */
+    int ch5 = channel(sizeof(int), 0);
+    assert(ch5 >= 0);
+    struct chclause cls4[] = {{ch5, CHRECV, &val, sizeof(val)}};
+    int sel4 = chselector(cls4, 1);
+    assert(sel4 >= 0);
+    rc = hclose(ch5);
+    assert(rc == 0);
+    rc = chselect(sel4, -1);
+    assert(rc == 0 && errno == EPIPE);
+
+    /* Invalid clauses. */
+    struct chclause cls5[] = {{ch[0], CHRECV, &val, 1}};
+    rc = chselector(cls5, 1);
+    assert(rc == -1 && errno == EINVAL);
+
+    rc = hclose(sel4);
+    assert(rc == 0);
+    rc = hclose(sel3);
+    assert(rc == 0);
+    rc = hclose(sel2);
+    assert(rc == 0);
+    rc = hclose(sel1);
+    assert(rc == 0);
+    hclose(ch4);
+    for(i = 0; i != 3; ++i)
+        hclose(ch[i]);
+
+    return 0;
+}
+
@@ -46,6 +46,11 @@ coroutine void trigger(int fd, int64_t deadline) {
     assert(sz == 1);
 }
 
+coroutine void expiring(int fd, int64_t deadline) {
+    int rc = fdwait(fd, FDW_IN, deadline);
+    assert(rc == FDW_IN || (rc == -1 && errno == ETIMEDOUT));
+}
+
 int main() {
     /* Create a pair of file deshndliptors for testing. */
     int fds[2];
@@ -144,6 +149,25 @@ int main() {
     rc = close(fds[1]);
     assert(rc == 0);
 
+    /* The file descriptor becomes readable and the deadline expires
+       at the same time. */
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    assert(rc == 0);
+    deadline = now() + 10;
+    int cr = go(expiring(fds[0], deadline));
+    assert(cr >= 0);
+    sz = send(fds[1], "A", 1, 0);
+    assert(sz == 1);
+    while(now() < deadline + 10);
+    rc = msleep(now() + 10);
+    assert(rc == 0);
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = close(fds[0]);
+    assert(rc == 0);
+    rc = close(fds[1]);
+    assert(rc == 0);
+
     return 0;
 }
 
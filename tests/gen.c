@@ -0,0 +1,113 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+
+#include "../libdill.h"
+
+coroutine void counter(int count) {
+    int i;
+    for(i = 0; i != count; ++i) {
+        int rc = genyield(&i, sizeof(i));
+        assert(rc == 0);
+    }
+}
+
+coroutine void slowcounter(int count) {
+    int i;
+    for(i = 0; i != count; ++i) {
+        int rc = msleep(now() + 10);
+        assert(rc == 0);
+        rc = genyield(&i, sizeof(i));
+        assert(rc == 0);
+    }
+}
+
+coroutine void forever(void) {
+    int i = 0;
+    while(1) {
+        int rc = genyield(&i, sizeof(i));
+        if(rc == -1 && errno == ECANCELED)
+            return;
+        assert(rc == 0);
+        ++i;
+    }
+}
+
+int main(void) {
+    int val, rc, i;
+
+    /* Pull all the values from a generator. */
+    int g = go(counter(1000));
+    assert(g >= 0);
+    for(i = 0; i != 1000; ++i) {
+        rc = gennext(g, &val, sizeof(val), -1);
+        assert(rc == 0);
+        assert(val == i);
+    }
+    rc = gennext(g, &val, sizeof(val), -1);
+    assert(rc == -1 && errno == EPIPE);
+    rc = gennext(g, &val, sizeof(val), -1);
+    assert(rc == -1 && errno == EPIPE);
+    rc = hclose(g);
+    assert(rc == 0);
+
+    /* Generator that blocks in between the values. */
+    g = go(slowcounter(3));
+    assert(g >= 0);
+    rc = gennext(g, &val, sizeof(val), now() + 5);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = gennext(g, &val, sizeof(val), 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    for(i = 0; i != 3; ++i) {
+        rc = gennext(g, &val, sizeof(val), -1);
+        assert(rc == 0);
+        assert(val == i);
+    }
+    rc = gennext(g, &val, sizeof(val), -1);
+    assert(rc == -1 && errno == EPIPE);
+    rc = hclose(g);
+    assert(rc == 0);
+
+    /* Closing an infinite generator cancels it. */
+    g = go(forever());
+    assert(g >= 0);
+    for(i = 0; i != 10; ++i) {
+        rc = gennext(g, &val, sizeof(val), -1);
+        assert(rc == 0);
+        assert(val == i);
+    }
+    char c;
+    rc = gennext(g, &c, sizeof(c), -1);
+    assert(rc == -1 && errno == EINVAL);
+    rc = gennext(g, &val, sizeof(val), -1);
+    assert(rc == 0);
+    assert(val == 10);
+    rc = hclose(g);
+    assert(rc == 0);
+
+    return 0;
+}
+
@@ -46,6 +46,13 @@ coroutine void worker(int count, int n) {
 
 static int worker2_done = 0;
 
+coroutine int square(int x, int64_t deadline) {
+    int rc = msleep(deadline);
+    if(rc < 0)
+        return -1;
+    return x * x;
+}
+
 coroutine void worker2(void) {
     int rc = msleep(now() + 1000);
     assert(rc == -1 && errno == ECANCELED);
@@ -111,6 +118,48 @@ int main() {
     rc = msleep(now() + 100);
     assert(rc == 0);
 
+    /* Test joining coroutines. */
+    intptr_t res;
+    int cr4 = goresult(square(3, now() + 10));
+    assert(cr4 >= 0);
+    rc = cojoin(cr4, &res, 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = cojoin(cr4, &res, -1);
+    assert(rc == 0 && res == 9);
+    /* The handle was released by cojoin(). */
+    rc = hclose(cr4);
+    assert(rc == -1 && errno == EBADF);
+    cr4 = goresult(square(4, now()));
+    assert(cr4 >= 0);
+    rc = msleep(now() + 10);
+    assert(rc == 0);
+    rc = cojoin(cr4, &res, -1);
+    assert(rc == 0 && res == 16);
+    cr4 = goresult(square(5, -1));
+    assert(cr4 >= 0);
+    rc = cojoin(cr4, &res, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = hclose(cr4);
+    assert(rc == 0);
+    /* Plain go() returns zero. */
+    cr4 = go(dummy());
+    assert(cr4 >= 0);
+    rc = cojoin(cr4, &res, -1);
+    assert(rc == 0 && res == 0);
+
+    /* Test joining any of multiple coroutines. */
+    int crs[3];
+    crs[0] = goresult(square(2, now() + 100));
+    crs[1] = goresult(square(3, now() + 20));
+    crs[2] = goresult(square(4, now() + 50));
+    rc = cojoinany(crs, 3, &res, -1);
+    assert(rc == 1 && res == 9);
+    crs[1] = crs[2];
+    rc = cojoinany(crs, 2, &res, -1);
+    assert(rc == 1 && res == 16);
+    rc = cojoinany(crs, 1, &res, -1);
+    assert(rc == 0 && res == 4);
+
     return 0;
 }
 
@@ -0,0 +1,106 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+
+#include "../libdill.h"
+
+static int finished = 0;
+static int canceled = 0;
+
+coroutine void sleeper(int64_t deadline) {
+    int rc = msleep(deadline);
+    if(rc == -1 && errno == ECANCELED) {
+        ++canceled;
+        return;
+    }
+    assert(rc == 0);
+    ++finished;
+}
+
+coroutine void quick(void) {
+    ++finished;
+}
+
+int main(void) {
+    int i, rc;
+
+    /* Closing the group cancels all the members. */
+    int grp = group();
+    assert(grp >= 0);
+    for(i = 0; i != 1000; ++i) {
+        rc = groupgo(grp, sleeper(-1));
+        assert(rc == 0);
+    }
+    /* A coroutine that has already finished can be added as well. */
+    rc = groupgo(grp, quick());
+    assert(rc == 0);
+    assert(finished == 1);
+    rc = groupwait(grp, 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = groupwait(grp, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = hclose(grp);
+    assert(rc == 0);
+    assert(canceled == 1000);
+
+    /* Waiting for the members to finish. */
+    grp = group();
+    assert(grp >= 0);
+    finished = 0;
+    for(i = 0; i != 100; ++i) {
+        rc = groupgo(grp, sleeper(now() + i % 10));
+        assert(rc == 0);
+    }
+    rc = groupwait(grp, -1);
+    assert(rc == 0);
+    assert(finished == 100);
+    rc = groupwait(grp, 0);
+    assert(rc == 0);
+
+    /* Adding a coroutine handle. */
+    int h = go(sleeper(-1));
+    assert(h >= 0);
+    rc = groupadd(grp, h);
+    assert(rc == 0);
+    rc = groupadd(grp, grp);
+    assert(rc == -1 && errno == ENOTSUP);
+    rc = hclose(grp);
+    assert(rc == 0);
+    assert(canceled == 1001);
+
+    /* If the coroutine can't be added to the group it's not left running. */
+    h = go(sleeper(-1));
+    assert(h >= 0);
+    rc = groupgo(h, sleeper(-1));
+    assert(rc == -1 && errno == ENOTSUP);
+    assert(canceled == 1002);
+    rc = hclose(h);
+    assert(rc == 0);
+    assert(canceled == 1003);
+
+    return 0;
+}
+
@@ -0,0 +1,84 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <errno.h>
+#include <assert.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../libdill.h"
+
+coroutine void sender(int ch) {
+    int rc = yield();
+    assert(rc == 0);
+    int val = 1;
+    rc = chsend(ch, &val, sizeof(val), -1);
+    assert(rc == 0);
+}
+
+coroutine void child(int ch, int64_t deadline, int tk, int fd) {
+    /* The timer removed in the parent is re-armed with the same deadline. */
+    int val;
+    int rc = chrecv_us(ch, &val, sizeof(val), deadline);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    /* The ticker's timer was not active in the child. */
+    rc = hclose(tk);
+    assert(rc == 0);
+    rc = msleep(now() + 10);
+    assert(rc == 0);
+    ssize_t sz = write(fd, "A", 1);
+    assert(sz == 1);
+    close(fd);
+}
+
+int main() {
+    /* Pipe to check whether child have failed. */
+    int fds[2];
+    int rc = pipe(fds);
+    assert(rc == 0);
+    /* Leave timers in the wheel before forking. */
+    int tk = ticker(1000);
+    assert(tk >= 0);
+    int ch = channel(sizeof(int), 0);
+    assert(ch >= 0);
+    int h = go(sender(ch));
+    assert(h >= 0);
+    int64_t deadline = now_us() + 50000;
+    int val;
+    rc = chrecv_us(ch, &val, sizeof(val), deadline);
+    assert(rc == 0 && val == 1);
+    /* Fork. */
+    h = proc(child(ch, deadline, tk, fds[1]));
+    assert(h >= 0);
+    close(fds[1]);
+    /* Parent waits for the child. */
+    rc = fdwait(fds[0], FDW_IN, now() + 1000);
+    assert(rc > 0 && (rc & FDW_IN));
+    char c;
+    ssize_t sz = read(fds[0], &c, 1);
+    assert(sz == 1);
+
+    return 0;
+}
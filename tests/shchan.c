@@ -0,0 +1,125 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "../libdill.h"
+
+/* Receives 'count' numbers and sends back their sum. */
+coroutine void adder(int in, int out, int count) {
+    long sum = 0;
+    int i;
+    for(i = 0; i != count; ++i) {
+        int val;
+        int rc = chrecv(in, &val, sizeof(val), -1);
+        assert(rc == 0);
+        sum += val;
+    }
+    int rc = chsend(out, &sum, sizeof(sum), -1);
+    assert(rc == 0);
+}
+
+/* Sends and receives on the same channel without ever blocking. */
+coroutine void pingpong(int ch) {
+    while(1) {
+        int val = 0;
+        int rc = chsend(ch, &val, sizeof(val), -1);
+        if(rc < 0) {
+            assert(errno == ECANCELED);
+            return;
+        }
+        rc = chrecv(ch, &val, sizeof(val), -1);
+        if(rc < 0) {
+            assert(errno == ECANCELED);
+            return;
+        }
+    }
+}
+
+int main(void) {
+    int rc = shchannel(sizeof(int), SIZE_MAX / 2);
+    assert(rc == -1 && errno == EINVAL);
+
+    int in = shchannel(sizeof(int), 4);
+    assert(in >= 0);
+    int out = shchannel(sizeof(long), 1);
+    assert(out >= 0);
+
+    /* Non-blocking operations. */
+    int val = 1;
+    rc = chrecv(in, &val, sizeof(val), 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = chrecv(in, &val, sizeof(val), now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = chsend(in, &val, sizeof(val), 0);
+    assert(rc == 0);
+    rc = chrecv(in, &val, sizeof(val), 0);
+    assert(rc == 0 && val == 1);
+    rc = chsend(in, &val, sizeof(val) - 1, 0);
+    assert(rc == -1 && errno == EINVAL);
+    int i;
+    for(i = 0; i != 4; ++i) {
+        rc = chsend(in, &i, sizeof(i), 0);
+        assert(rc == 0);
+    }
+    rc = chsend(in, &i, sizeof(i), 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    for(i = 0; i != 4; ++i) {
+        rc = chrecv(in, &val, sizeof(val), 0);
+        assert(rc == 0 && val == i);
+    }
+
+    /* Pass messages to a child process and back. The small buffer makes
+       both processes block repeatedly. */
+    int h = proc(adder(in, out, 10000));
+    assert(h >= 0);
+    long expected = 0;
+    for(i = 0; i != 10000; ++i) {
+        rc = chsend(in, &i, sizeof(i), -1);
+        assert(rc == 0);
+        expected += i;
+    }
+    long sum;
+    rc = chrecv(out, &sum, sizeof(sum), -1);
+    assert(rc == 0);
+    assert(sum == expected);
+    rc = hclose(h);
+    assert(rc == 0);
+
+    /* Operations that never block still let other coroutines run and fail
+       once the coroutine is canceled. */
+    h = go(pingpong(in));
+    assert(h >= 0);
+    rc = hclose(h);
+    assert(rc == 0);
+
+    rc = hclose(out);
+    assert(rc == 0);
+    rc = hclose(in);
+    assert(rc == 0);
+    return 0;
+}
+
@@ -23,9 +23,11 @@
 */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "../libdill.h"
 
@@ -36,6 +38,53 @@ coroutine static void delay(int n, int ch) {
     assert(rc == 0);
 }
 
+coroutine static void feeder(int ch, int n) {
+    int i;
+    for(i = 0; i != n; ++i) {
+        int rc = chsend(ch, &i, sizeof(i), -1);
+        assert(rc == 0);
+    }
+}
+
+coroutine static void sleeper(int64_t deadline, int *count) {
+    int rc = msleep(deadline);
+    assert(rc == 0);
+    ++*count;
+}
+
+coroutine static void scoped(int ch) {
+    /* The scope is inherited from the parent. */
+    int64_t ddline = getdeadline_us();
+    assert(ddline >= 0);
+    int val;
+    int rc = chrecv(ch, &val, sizeof(val), -1);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    assert(now_us() >= ddline);
+    rc = chsend(ch, &val, sizeof(val), -1);
+    assert(rc == -1 && errno == ETIMEDOUT);
+}
+
+coroutine static void delayuntil(int64_t deadline, int n, int ch) {
+    int rc = msleep(deadline);
+    assert(rc == 0);
+    rc = chsend(ch, &n, sizeof(n), -1);
+    assert(rc == 0);
+}
+
+/* Waits for a message till the deadline, then without a deadline, then
+   re-arms the original deadline. */
+coroutine static void rearmer(int ch, int64_t deadline) {
+    int val;
+    int rc = chrecv_us(ch, &val, sizeof(val), deadline);
+    assert(rc == 0);
+    rc = chrecv(ch, &val, sizeof(val), -1);
+    assert(rc == 0);
+    rc = chrecv_us(ch, &val, sizeof(val), deadline);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    int64_t diff = now_us() - deadline;
+    assert(diff >= 0 && diff < 20000);
+}
+
 int main() {
     /* Test 'msleep'. */
     int64_t deadline = now() + 100;
@@ -75,6 +124,220 @@ int main() {
     hclose(hndls[3]);
     hclose(ch);
 
+    /* Timers with the same deadline fire in the order they were created in,
+       no matter how far in the future they were set. */
+    ch = channel(sizeof(int), 0);
+    assert(ch >= 0);
+    deadline = now() + 300;
+    int hndls2[20];
+    int i;
+    for(i = 0; i != 20; ++i) {
+        hndls2[i] = go(delayuntil(deadline, i, ch));
+        assert(hndls2[i] >= 0);
+        rc = msleep(now() + 13);
+        assert(rc == 0);
+    }
+    for(i = 0; i != 20; ++i) {
+        rc = chrecv(ch, &val, sizeof(val), -1);
+        assert(rc == 0);
+        assert(val == i);
+    }
+    diff = now() - deadline;
+    assert(diff > -20 && diff < 20);
+    for(i = 0; i != 20; ++i)
+        hclose(hndls2[i]);
+    hclose(ch);
+
+    /* Timer slack batches the wakeups. */
+    rc = timerslack(-1);
+    assert(rc == -1 && errno == EINVAL);
+    rc = timerslack(200);
+    assert(rc == 0);
+    ch = channel(sizeof(int), 20);
+    assert(ch >= 0);
+    struct timerstats st1;
+    rc = timerstats(&st1);
+    assert(rc == 0);
+    for(i = 0; i != 20; ++i) {
+        hndls2[i] = go(delay(i * 5, ch));
+        assert(hndls2[i] >= 0);
+    }
+    for(i = 0; i != 20; ++i) {
+        rc = chrecv(ch, &val, sizeof(val), -1);
+        assert(rc == 0);
+    }
+    struct timerstats st2;
+    rc = timerstats(&st2);
+    assert(rc == 0);
+    assert(st2.fired - st1.fired == 20);
+    assert(st2.timer_wakeups - st1.timer_wakeups <= 2);
+    for(i = 0; i != 20; ++i)
+        hclose(hndls2[i]);
+    hclose(ch);
+    rc = timerslack(0);
+    assert(rc == 0);
+
+    /* Sub-millisecond sleeps. */
+    int64_t start = now_us();
+    for(i = 0; i != 50; ++i) {
+        int64_t ddline = now_us() + 100;
+        rc = msleep_us(ddline);
+        assert(rc == 0);
+        assert(now_us() >= ddline);
+    }
+    /* With millisecond timeouts this would take at least 50ms. */
+    assert(now_us() - start < 40000);
+    ch = channel(sizeof(int), 0);
+    assert(ch >= 0);
+    int64_t ddline = now_us() + 500;
+    rc = chrecv_us(ch, &val, sizeof(val), ddline);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    assert(now_us() >= ddline);
+    hclose(ch);
+
+    /* now() has to agree with the system clock. */
+    for(i = 0; i != 10; ++i) {
+        struct timespec ts;
+        rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+        assert(rc == 0);
+        int64_t us = now_us();
+        diff = us - ((int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+        assert(diff > -1000 && diff < 1000);
+        diff = now() - us / 1000;
+        assert(diff >= 0 && diff <= 1);
+        rc = msleep(now() + 20);
+        assert(rc == 0);
+    }
+
+    /* Tickers. */
+    int tk = ticker(0);
+    assert(tk == -1 && errno == EINVAL);
+    tk = ticker(20);
+    assert(tk >= 0);
+    start = now();
+    uint64_t ticks;
+    for(i = 1; i != 6; ++i) {
+        rc = chrecv(tk, &ticks, sizeof(ticks), -1);
+        assert(rc == 0 && ticks == 1);
+        diff = now() - (start + i * 20);
+        assert(diff > -5 && diff < 20);
+    }
+    rc = chsend(tk, &ticks, sizeof(ticks), -1);
+    assert(rc == -1 && errno == EINVAL);
+    /* Missed ticks are reported, not queued. */
+    rc = msleep(start + 5 * 20 + 70);
+    assert(rc == 0);
+    rc = chrecv(tk, &ticks, sizeof(ticks), 0);
+    assert(rc == 0 && ticks == 3);
+    rc = chrecv(tk, &ticks, sizeof(ticks), 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    struct chclause cls1[] = {{tk, CHRECV, &ticks, sizeof(ticks)}};
+    rc = choose(cls1, 1, -1);
+    assert(rc == 0 && errno == 0 && ticks == 1);
+    diff = now() - (start + 9 * 20);
+    assert(diff > -5 && diff < 20);
+    rc = hclose(tk);
+    assert(rc == 0);
+
+    /* Timer budget. */
+    rc = timerbudget(-1);
+    assert(rc == -1 && errno == EINVAL);
+    rc = timerbudget(10);
+    assert(rc == 0);
+    int grp = group();
+    assert(grp >= 0);
+    int count = 0;
+    deadline = now() + 20;
+    for(i = 0; i != 100; ++i) {
+        rc = groupgo(grp, sleeper(deadline, &count));
+        assert(rc >= 0);
+    }
+    rc = timerstats(&st1);
+    assert(rc == 0);
+    rc = groupwait(grp, -1);
+    assert(rc == 0);
+    assert(count == 100);
+    rc = timerstats(&st2);
+    assert(rc == 0);
+    assert(st2.deferred - st1.deferred >= 9);
+    rc = timerbudget(0);
+    assert(rc == 0);
+    hclose(grp);
+
+    /* Deadline scopes. */
+    assert(getdeadline() == -1);
+    rc = setdeadline(-2);
+    assert(rc == -1 && errno == EINVAL);
+    ch = channel(sizeof(int), 0);
+    assert(ch >= 0);
+    deadline = now() + 30;
+    rc = setdeadline(deadline);
+    assert(rc == 0);
+    assert(getdeadline() == deadline);
+    int sc = go(scoped(ch));
+    assert(sc >= 0);
+    rc = msleep(now() + 10);
+    assert(rc == 0);
+    rc = msleep(-1);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    diff = now() - deadline;
+    assert(diff >= 0 && diff < 20);
+    rc = cojoin(sc, NULL, -1);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = setdeadline(-1);
+    assert(rc == 0);
+    rc = cojoin(sc, NULL, -1);
+    assert(rc == 0);
+    hclose(ch);
+
+    /* Timers removed before expiry and re-armed with the same deadline. */
+    ch = channel(sizeof(int), 0);
+    assert(ch >= 0);
+    int cr = go(feeder(ch, 1000));
+    assert(cr >= 0);
+    deadline = now() + 50;
+    for(i = 0; i != 1000; ++i) {
+        rc = chrecv(ch, &val, sizeof(val), deadline);
+        assert(rc == 0 && val == i);
+        if(i % 100 == 0) {
+            rc = chrecv(ch, &val, sizeof(val), now() + 10000);
+            assert(rc == 0 && val == ++i);
+        }
+    }
+    rc = hclose(cr);
+    assert(rc == 0);
+    rc = chrecv(ch, &val, sizeof(val), deadline);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    diff = now() - deadline;
+    assert(diff >= 0 && diff < 20);
+    hclose(ch);
+
+    /* A removed timer left in a higher level slot while the wheel was empty
+       and re-armed after the time of the slot has passed. The deadline is
+       the last microsecond of a 262ms level 3 slot. */
+    ch = channel(sizeof(int), 0);
+    assert(ch >= 0);
+    int64_t deadline_us = (now_us() + 300000) | 262143;
+    int ra = go(rearmer(ch, deadline_us));
+    assert(ra >= 0);
+    rc = chsend(ch, &val, sizeof(val), -1);
+    assert(rc == 0);
+    rc = yield();
+    assert(rc == 0);
+    /* Sleep without libdill knowing. */
+    while(now_us() < (deadline_us & ~(int64_t)262143) + 1000) {
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+    rc = msleep_us(now_us() + 1000);
+    assert(rc == 0);
+    assert(now_us() < deadline_us);
+    rc = chsend(ch, &val, sizeof(val), -1);
+    assert(rc == 0);
+    rc = cojoin(ra, NULL, -1);
+    assert(rc == 0);
+    hclose(ch);
+
     return 0;
 }
 
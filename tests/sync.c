@@ -0,0 +1,312 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "../libdill.h"
+
+static int counter = 0;
+
+/* Increments the counter non-atomically, yielding in the middle. */
+coroutine void incrementer(int m, int count) {
+    int i;
+    for(i = 0; i != count; ++i) {
+        int rc = mutexlock(m, -1);
+        assert(rc == 0);
+        int val = counter;
+        rc = yield();
+        assert(rc == 0);
+        counter = val + 1;
+        rc = mutexunlock(m);
+        assert(rc == 0);
+    }
+}
+
+coroutine void locker(int m, int64_t deadline, int err) {
+    int rc = mutexlock(m, deadline);
+    if(err) {
+        assert(rc == -1 && errno == err);
+        return;
+    }
+    assert(rc == 0);
+    rc = mutexunlock(m);
+    assert(rc == 0);
+}
+
+coroutine void acquirer(int s, int done) {
+    int rc = semacquire(s, -1);
+    assert(rc == 0);
+    rc = semrelease(done);
+    assert(rc == 0);
+}
+
+static int ready = 0;
+
+coroutine void condwaiter(int cv, int m, int done) {
+    int rc = mutexlock(m, -1);
+    assert(rc == 0);
+    while(!ready) {
+        rc = condwait(cv, m, -1);
+        assert(rc == 0);
+    }
+    rc = mutexunlock(m);
+    assert(rc == 0);
+    rc = semrelease(done);
+    assert(rc == 0);
+}
+
+/* Times out in condwait() because of the deadline scope but has to wait for
+   the mutex held by the main coroutine to be able to return. */
+coroutine void scopedwaiter(int cv, int m, int done) {
+    int rc = mutexlock(m, -1);
+    assert(rc == 0);
+    rc = setdeadline(now() + 10);
+    assert(rc == 0);
+    rc = condwait(cv, m, -1);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = mutexunlock(m);
+    assert(rc == 0);
+    rc = semrelease(done);
+    assert(rc == 0);
+}
+
+coroutine void closedwaiter(int cv, int m) {
+    int rc = mutexlock(m, -1);
+    assert(rc == 0);
+    rc = condwait(cv, m, -1);
+    assert(rc == -1 && errno == EBADF);
+}
+
+coroutine void delayedwriter(int fd, int64_t deadline) {
+    int rc = msleep(deadline);
+    assert(rc == 0);
+    ssize_t sz = write(fd, "A", 1);
+    assert(sz == 1);
+}
+
+int main(void) {
+    int i, rc;
+
+    /* Mutual exclusion. */
+    int m = mutex();
+    assert(m >= 0);
+    int hndls[3];
+    for(i = 0; i != 3; ++i) {
+        hndls[i] = go(incrementer(m, 100));
+        assert(hndls[i] >= 0);
+    }
+    rc = msleep(now() + 50);
+    assert(rc == 0);
+    assert(counter == 300);
+    for(i = 0; i != 3; ++i) {
+        rc = hclose(hndls[i]);
+        assert(rc == 0);
+    }
+
+    /* Error cases. */
+    rc = mutexunlock(m);
+    assert(rc == -1 && errno == EPERM);
+    rc = mutexlock(m, -1);
+    assert(rc == 0);
+    rc = mutexlock(m, -1);
+    assert(rc == -1 && errno == EDEADLK);
+    rc = mutexunlock(m);
+    assert(rc == 0);
+
+    /* Lock timeout and cancellation. */
+    rc = mutexlock(m, -1);
+    assert(rc == 0);
+    int h1 = go(locker(m, now() + 10, ETIMEDOUT));
+    assert(h1 >= 0);
+    int h2 = go(locker(m, 0, ETIMEDOUT));
+    assert(h2 >= 0);
+    int h3 = go(locker(m, -1, ECANCELED));
+    assert(h3 >= 0);
+    rc = msleep(now() + 50);
+    assert(rc == 0);
+    rc = hclose(h3);
+    assert(rc == 0);
+    rc = hclose(h2);
+    assert(rc == 0);
+    rc = hclose(h1);
+    assert(rc == 0);
+    /* Nobody is waiting anymore. */
+    rc = mutexunlock(m);
+    assert(rc == 0);
+    rc = mutexlock(m, 0);
+    assert(rc == 0);
+    rc = mutexunlock(m);
+    assert(rc == 0);
+
+    /* Closing the mutex unblocks the waiters. */
+    rc = mutexlock(m, -1);
+    assert(rc == 0);
+    h1 = go(locker(m, -1, EBADF));
+    assert(h1 >= 0);
+    rc = yield();
+    assert(rc == 0);
+    rc = hclose(m);
+    assert(rc == 0);
+    rc = hclose(h1);
+    assert(rc == 0);
+
+    /* Semaphore. */
+    int s = semaphore(2);
+    assert(s >= 0);
+    int done = semaphore(0);
+    assert(done >= 0);
+    rc = semaphore(-1);
+    assert(rc == -1 && errno == EINVAL);
+    for(i = 0; i != 3; ++i) {
+        hndls[i] = go(acquirer(s, done));
+        assert(hndls[i] >= 0);
+    }
+    rc = semacquire(done, -1);
+    assert(rc == 0);
+    rc = semacquire(done, -1);
+    assert(rc == 0);
+    rc = semacquire(done, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    /* Releasing the unit hands it directly to the blocked coroutine. */
+    rc = semrelease(s);
+    assert(rc == 0);
+    rc = semacquire(done, -1);
+    assert(rc == 0);
+    rc = semacquire(s, 0);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    for(i = 0; i != 3; ++i) {
+        rc = hclose(hndls[i]);
+        assert(rc == 0);
+    }
+    rc = hclose(s);
+    assert(rc == 0);
+
+    /* Condition variable with broadcast. */
+    m = mutex();
+    assert(m >= 0);
+    int cv = condvar();
+    assert(cv >= 0);
+    for(i = 0; i != 3; ++i) {
+        hndls[i] = go(condwaiter(cv, m, done));
+        assert(hndls[i] >= 0);
+    }
+    rc = msleep(now() + 10);
+    assert(rc == 0);
+    rc = condsignal(cv);
+    assert(rc == 0);
+    rc = semacquire(done, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = mutexlock(m, -1);
+    assert(rc == 0);
+    ready = 1;
+    rc = condbroadcast(cv);
+    assert(rc == 0);
+    rc = mutexunlock(m);
+    assert(rc == 0);
+    for(i = 0; i != 3; ++i) {
+        rc = semacquire(done, -1);
+        assert(rc == 0);
+    }
+    for(i = 0; i != 3; ++i) {
+        rc = hclose(hndls[i]);
+        assert(rc == 0);
+    }
+
+    /* Timed wait for a condition returns with the mutex held. */
+    rc = mutexlock(m, -1);
+    assert(rc == 0);
+    rc = condwait(cv, m, now() + 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = mutexunlock(m);
+    assert(rc == 0);
+    rc = condwait(cv, m, -1);
+    assert(rc == -1 && errno == EPERM);
+
+    /* An expired deadline scope doesn't prevent relocking the mutex. */
+    rc = mutexlock(m, -1);
+    assert(rc == 0);
+    rc = setdeadline(now());
+    assert(rc == 0);
+    rc = condwait(cv, m, -1);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    rc = setdeadline(-1);
+    assert(rc == 0);
+    rc = mutexunlock(m);
+    assert(rc == 0);
+    int fds[2];
+    rc = pipe(fds);
+    assert(rc == 0);
+    struct timerstats before, after;
+    rc = timerstats(&before);
+    assert(rc == 0);
+    int h = go(scopedwaiter(cv, m, done));
+    assert(h >= 0);
+    rc = mutexlock(m, -1);
+    assert(rc == 0);
+    int w = go(delayedwriter(fds[1], now() + 50));
+    assert(w >= 0);
+    rc = fdwait(fds[0], FDW_IN, -1);
+    assert(rc == FDW_IN);
+    char c;
+    ssize_t sz = read(fds[0], &c, 1);
+    assert(sz == 1);
+    rc = mutexunlock(m);
+    assert(rc == 0);
+    rc = semacquire(done, now() + 1000);
+    assert(rc == 0);
+    /* The waiter didn't spin on its expired deadline while relocking. */
+    rc = timerstats(&after);
+    assert(rc == 0);
+    assert(after.fired - before.fired < 10);
+    rc = hclose(w);
+    assert(rc == 0);
+    rc = hclose(h);
+    assert(rc == 0);
+    fdclean(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+
+    /* Closing the mutex while waiting for the condition. */
+    int m2 = mutex();
+    assert(m2 >= 0);
+    h = go(closedwaiter(cv, m2));
+    assert(h >= 0);
+    rc = hclose(m2);
+    assert(rc == 0);
+    rc = condsignal(cv);
+    assert(rc == 0);
+    rc = cojoin(h, NULL, -1);
+    assert(rc == 0);
+
+    rc = hclose(cv);
+    assert(rc == 0);
+    rc = hclose(m);
+    assert(rc == 0);
+    rc = hclose(done);
+    assert(rc == 0);
+    return 0;
+}
+
@@ -0,0 +1,151 @@
+/*
+
+  Copyright (c) 2016 Martin Sustrik
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"),
+  to deal in the Software without restriction, including without limitation
+  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+  and/or sell copies of the Software, and to permit persons to whom
+  the Software is furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+  THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../libdill.h"
+
+static int64_t realnow(void) {
+    struct timespec ts;
+    int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(rc == 0);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+coroutine static void delay(int64_t n, int ch) {
+    int rc = msleep(now() + n);
+    assert(rc == 0);
+    rc = chsend(ch, &n, sizeof(n), -1);
+    assert(rc == 0);
+}
+
+coroutine static void writer(int fd, int64_t deadline) {
+    int rc = msleep(deadline);
+    assert(rc == 0);
+    ssize_t sz = send(fd, "A", 1, 0);
+    assert(sz == 1);
+}
+
+int main() {
+    dovirtualtime(1);
+    int64_t start = now();
+    int64_t realstart = realnow();
+
+    /* A day of sleeping takes no time. */
+    int rc = msleep(now() + 24 * 3600 * 1000);
+    assert(rc == 0);
+    assert(now() == start + 24 * 3600 * 1000);
+
+    /* The clock doesn't move while coroutines are running. */
+    int64_t tm = now_us();
+    rc = yield();
+    assert(rc == 0);
+    assert(now_us() == tm);
+
+    /* Timers fire in order, each at its exact deadline. */
+    int ch = channel(sizeof(int64_t), 0);
+    assert(ch >= 0);
+    int hndls[4];
+    hndls[0] = go(delay(3000, ch));
+    hndls[1] = go(delay(60000, ch));
+    hndls[2] = go(delay(1000, ch));
+    hndls[3] = go(delay(2000, ch));
+    start = now();
+    int64_t val;
+    int64_t expected[] = {1000, 2000, 3000, 60000};
+    int i;
+    for(i = 0; i != 4; ++i) {
+        rc = chrecv(ch, &val, sizeof(val), -1);
+        assert(rc == 0 && val == expected[i]);
+        assert(now() == start + val);
+    }
+    for(i = 0; i != 4; ++i)
+        hclose(hndls[i]);
+    hclose(ch);
+
+    /* Deadlines work as well. */
+    ch = channel(sizeof(int64_t), 0);
+    assert(ch >= 0);
+    int64_t deadline = now() + 3600 * 1000;
+    rc = chrecv(ch, &val, sizeof(val), deadline);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    assert(now() == deadline);
+    hclose(ch);
+
+    /* Tickers. */
+    int tk = ticker(60 * 1000);
+    assert(tk >= 0);
+    start = now();
+    for(i = 1; i != 100; ++i) {
+        uint64_t ticks;
+        rc = chrecv(tk, &ticks, sizeof(ticks), -1);
+        assert(rc == 0 && ticks == 1);
+        assert(now() == start + i * 60 * 1000);
+    }
+    hclose(tk);
+
+    /* File descriptors are still polled. */
+    int fds[2];
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    assert(rc == 0);
+    deadline = now() + 1000;
+    int hndl = go(writer(fds[1], deadline));
+    assert(hndl >= 0);
+    rc = fdwait(fds[0], FDW_IN, now() + 3600 * 1000);
+    assert(rc == FDW_IN);
+    assert(now() == deadline);
+    hclose(hndl);
+    fdclean(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+
+    /* Switching the virtual time off neither moves the clock back nor
+       delays the timers that are already running. */
+    ch = channel(sizeof(int64_t), 0);
+    assert(ch >= 0);
+    hndl = go(delay(10, ch));
+    assert(hndl >= 0);
+    tm = now_us();
+    dovirtualtime(0);
+    assert(now_us() >= tm);
+    rc = chrecv(ch, &val, sizeof(val), now() + 500);
+    assert(rc == 0 && val == 10);
+    deadline = now() + 20;
+    rc = msleep(deadline);
+    assert(rc == 0);
+    int64_t diff = now() - deadline;
+    assert(diff >= 0 && diff < 20);
+    hclose(hndl);
+    hclose(ch);
+
+    /* All of the above took far less than the simulated time. */
+    assert(realnow() - realstart < 1000);
+
+    return 0;
+}
@@ -22,7 +22,9 @@
 
 */
 
+#include <errno.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -36,118 +38,584 @@ static mach_timebase_info_data_t dill_mtid = {0};
 #include "timer.h"
 #include "utils.h"
 
-/* 1 millisecond expressed in CPU ticks. The value is chosen is such a way that
-   it works reasonably well for CPU frequencies above 500MHz. On significanly
-   slower machines you may wish to reconsider. */
-#define DILL_CLOCK_PRECISION 1000000
-
-/* Returns current time by querying the operating system. */
-static int64_t dill_now(void) {
+/* Returns current time in nanoseconds by querying the operating system. */
+static int64_t dill_clock(void) {
 #if defined __APPLE__
     if (dill_slow(!dill_mtid.denom))
         mach_timebase_info(&dill_mtid);
     uint64_t ticks = mach_absolute_time();
-    return (int64_t)(ticks * dill_mtid.numer / dill_mtid.denom / 1000000);
+    return (int64_t)(ticks * dill_mtid.numer / dill_mtid.denom);
 #elif defined CLOCK_MONOTONIC
     struct timespec ts;
     int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
     dill_assert (rc == 0);
-    return ((int64_t)ts.tv_sec) * 1000 + (((int64_t)ts.tv_nsec) / 1000000);
+    return ((int64_t)ts.tv_sec) * 1000000000 + ((int64_t)ts.tv_nsec);
 #else
     struct timeval tv;
     int rc = gettimeofday(&tv, NULL);
     assert(rc == 0);
-    return ((int64_t)tv.tv_sec) * 1000 + (((int64_t)tv.tv_usec) / 1000);
+    return ((int64_t)tv.tv_sec) * 1000000000 + ((int64_t)tv.tv_usec) * 1000;
 #endif
 }
 
-int64_t now(void) {
-#if (defined __GNUC__ || defined __clang__) && \
-      (defined __i386__ || defined __x86_64__)
-    /* Get the timestamp counter. This is time since startup, expressed in CPU
-       cycles. Unlike gettimeofday() or similar function, it's extremely fast -
-       it takes only few CPU cycles to evaluate. */
+#if (defined __GNUC__ || defined __clang__) && defined __x86_64__
+#define DILL_TSC
+
+/* Time is computed from the timestamp counter which is much cheaper to read
+   than the OS clock. The TSC frequency isn't known upfront. It's measured
+   against the OS clock during the first few milliseconds of the process'
+   lifetime and refined each time the two clocks are re-synchronised. TSC is
+   used only if the CPU guarantees that it ticks at a constant rate
+   irrespective of the power state. */
+
+/* Minimum length of the initial calibration. */
+#define DILL_TSC_CALIBRATION 10000000
+/* How often to re-synchronise with the OS clock. */
+#define DILL_TSC_RESYNC 1000000000
+
+static struct {
+    /* 0 - not initialised yet, 1 - calibrating, 2 - calibrated,
+       -1 - TSC can't be used. */
+    int state;
+    /* The first measurement. Frequency is computed relative to it. */
+    uint64_t start_tsc;
+    int64_t start_ns;
+    /* The last synchronisation point. */
+    uint64_t base_tsc;
+    int64_t base_ns;
+    /* Nanoseconds per tick, as a 32.32 fixed-point number. */
+    uint64_t mult;
+    /* Number of ticks till the next re-synchronisation. */
+    uint64_t resync;
+} dill_tsc = {0};
+
+static inline uint64_t dill_rdtsc(void) {
     uint32_t low;
     uint32_t high;
     __asm__ volatile("rdtsc" : "=a" (low), "=d" (high));
-    int64_t tsc = (int64_t)((uint64_t)high << 32 | low);
-    /* These global variables are used to hold the last seen timestamp counter
-       and last seen time measurement. We'll initilise them the first time
-       this function is called. */
-    static int64_t last_tsc = -1;
-    static int64_t last_now = -1;
-    if(dill_slow(last_tsc < 0)) {
-        last_tsc = tsc;
-        last_now = dill_now();
-    }   
-    /* If TSC haven't jumped back or progressed more than 1/2 ms, we can use
-       the cached time value. */
-    if(dill_fast(tsc - last_tsc <= (DILL_CLOCK_PRECISION / 2) &&
-          tsc >= last_tsc))
-        return last_now;
-    /* It's more than 1/2 ms since we've last measured the time.
-       We'll do a new measurement now. */
-    last_tsc = tsc;
-    last_now = dill_now();
-    return last_now;
+    return (uint64_t)high << 32 | low;
+}
+
+/* Returns 1 if the CPU advertises invariant TSC. */
+static int dill_tsc_invariant(void) {
+    uint32_t a, b, c, d;
+    __asm__ volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d)
+        : "a" (0x80000000));
+    if(a < 0x80000007)
+        return 0;
+    __asm__ volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d)
+        : "a" (0x80000007));
+    return (d >> 8) & 1;
+}
+
+/* Slow path of dill_now_ns(). Reads the OS clock and (re-)calibrates TSC. */
+static int64_t dill_tsc_sync(uint64_t tsc) {
+    int64_t ns = dill_clock();
+    switch(dill_tsc.state) {
+    case 0:
+        if(!dill_tsc_invariant()) {
+            dill_tsc.state = -1;
+            return ns;
+        }
+        dill_tsc.start_tsc = tsc;
+        dill_tsc.start_ns = ns;
+        dill_tsc.state = 1;
+        return ns;
+    case 1:
+        if(ns - dill_tsc.start_ns < DILL_TSC_CALIBRATION)
+            return ns;
+        break;
+    case 2:
+        /* Don't let the time go backwards if the clocks have drifted apart.
+           If the process haven't asked for time for a long while there's no
+           need to care. */
+        if(tsc - dill_tsc.base_tsc < 2 * dill_tsc.resync) {
+            int64_t tm = dill_tsc.base_ns + (int64_t)(((unsigned __int128)
+                (tsc - dill_tsc.base_tsc) * dill_tsc.mult) >> 32);
+            if(tm > ns)
+                ns = tm;
+        }
+        break;
+    default:
+        return ns;
+    }
+    /* The longer the interval, the more precise the frequency. */
+    uint64_t ticks = tsc - dill_tsc.start_tsc;
+    if(dill_slow(ticks == 0 || tsc < dill_tsc.start_tsc ||
+          ns <= dill_tsc.start_ns)) {
+        dill_tsc.state = -1;
+        return ns;
+    }
+    dill_tsc.mult = (uint64_t)(((unsigned __int128)(ns - dill_tsc.start_ns)
+        << 32) / ticks);
+    if(dill_slow(!dill_tsc.mult)) {
+        dill_tsc.state = -1;
+        return ns;
+    }
+    dill_tsc.resync = ((uint64_t)DILL_TSC_RESYNC << 32) / dill_tsc.mult;
+    dill_tsc.base_tsc = tsc;
+    dill_tsc.base_ns = ns;
+    dill_tsc.state = 2;
+    return ns;
+}
+#endif
+
+/* Returns current real time in nanoseconds. */
+static int64_t dill_real_ns(void) {
+#if defined DILL_TSC
+    uint64_t tsc = dill_rdtsc();
+    uint64_t ticks = tsc - dill_tsc.base_tsc;
+    if(dill_fast(dill_tsc.state == 2 && ticks < dill_tsc.resync))
+        return dill_tsc.base_ns +
+            (int64_t)(((unsigned __int128)ticks * dill_tsc.mult) >> 32);
+    return dill_tsc_sync(tsc);
 #else
-    return dill_now();
+    return dill_clock();
 #endif
 }
 
-/* Global linked list of all timers. The list is ordered.
-   First timer to be resumed comes first and so on. */
-static struct dill_list dill_timers = {0};
+int dill_timer_virtual = 0;
 
-void dill_timer_add(struct dill_timer *timer, int64_t deadline) {
-    dill_assert(deadline >= 0);
-    timer->expiry = deadline;
-    /* Move the timer into the right place in the ordered list
-       of existing timers. TODO: This is an O(n) operation! */
-    struct dill_list_item *it = dill_list_begin(&dill_timers);
+/* Current virtual time, in nanoseconds. */
+static int64_t dill_timer_vnow = 0;
+
+/* Difference between the time reported by the library and the real time.
+   Non-zero once the virtual time was switched off. */
+static int64_t dill_timer_offset = 0;
+
+void dovirtualtime(int enable) {
+    if(enable && !dill_timer_virtual)
+        dill_timer_vnow = dill_real_ns() + dill_timer_offset;
+    /* Carry on from the virtual time so that the time doesn't go back and
+       the deadlines set meanwhile don't expire late. */
+    if(!enable && dill_timer_virtual)
+        dill_timer_offset = dill_timer_vnow - dill_real_ns();
+    dill_timer_virtual = enable ? 1 : 0;
+}
+
+void dill_timer_jump(int64_t us) {
+    dill_assert(dill_timer_virtual && us >= 0);
+    dill_timer_vnow += us * 1000;
+}
+
+/* Returns current time in nanoseconds. */
+static int64_t dill_now_ns(void) {
+    if(dill_slow(dill_timer_virtual))
+        return dill_timer_vnow;
+    return dill_real_ns() + dill_timer_offset;
+}
+
+static int64_t dill_now_us(void) {
+    return dill_now_ns() / 1000;
+}
+
+int64_t now_us(void) {
+    return dill_now_ns() / 1000;
+}
+
+int64_t now(void) {
+    return dill_now_ns() / 1000000;
+}
+
+/* Timers are kept in a hierarchical timing wheel. Level 0 has one slot per
+   microsecond, each subsequent level has slots 64 times longer than the
+   previous one. A timer is put to the lowest level that can hold it without
+   wrapping around. When the wheel's time reaches the start of a slot at
+   a higher level, the timers in the slot are moved to lower levels. Adding
+   and removing a timer is thus O(1). */
+#define DILL_WHEEL_BITS 6
+#define DILL_WHEEL_SLOTS (1 << DILL_WHEEL_BITS)
+#define DILL_WHEEL_MASK (DILL_WHEEL_SLOTS - 1)
+#define DILL_WHEEL_LEVELS 7
+
+/* When looking for the next expiry, slots at higher levels with at most this
+   many timers are inspected to get the exact expiry rather than the time
+   when the slot is cascaded. That avoids spurious wakeups. */
+#define DILL_WHEEL_SCAN 16
+
+static struct {
+    /* All timers expiring before this point in time were already fired.
+       Never ahead of the current time. */
+    int64_t now;
+    /* Number of active timers in the wheel. Timers that were removed but not
+       yet unlinked are not counted. */
+    size_t count;
+    /* Incremented for each timer added. */
+    uint64_t seq;
+    /* Bitmaps of non-empty slots at each level. */
+    uint64_t occupied[DILL_WHEEL_LEVELS];
+    struct dill_list slots[DILL_WHEEL_LEVELS][DILL_WHEEL_SLOTS];
+} dill_wheel = {0};
+
+/* Returns index of the first set bit in 'bits', starting at 'start' and
+   wrapping around. 'bits' must not be zero. */
+static int dill_wheel_first(uint64_t bits, int start) {
+    uint64_t r = start ? (bits >> start) | (bits << (64 - start)) : bits;
+    return (__builtin_ctzll(r) + start) & DILL_WHEEL_MASK;
+}
+
+/* Returns the time when the slot at the level will be processed. For level
+   0 that's the time the timers in the slot expire. For higher levels it's
+   the time when the slot is cascaded. */
+static int64_t dill_wheel_time(int level, int idx) {
+    int shift = level * DILL_WHEEL_BITS;
+    if(!level)
+        return dill_wheel.now + ((idx - dill_wheel.now) & DILL_WHEEL_MASK);
+    int64_t cur = dill_wheel.now >> shift;
+    return (cur + 1 + ((idx - cur - 1) & DILL_WHEEL_MASK)) << shift;
+}
+
+/* Index of the first non-empty slot to be processed at the level. */
+static int dill_wheel_start(int level) {
+    int64_t cur = dill_wheel.now >> (level * DILL_WHEEL_BITS);
+    return level ? (cur + 1) & DILL_WHEEL_MASK : cur & DILL_WHEEL_MASK;
+}
+
+/* Puts the timer to the right slot relative to the current wheel time. */
+static void dill_wheel_place(struct dill_timer *tm) {
+    int level = 0;
+    int64_t slot = dill_wheel.now;
+    if(tm->expiry > dill_wheel.now) {
+        while(1) {
+            int shift = level * DILL_WHEEL_BITS;
+            slot = tm->expiry >> shift;
+            int64_t cur = dill_wheel.now >> shift;
+            if(slot - cur < DILL_WHEEL_SLOTS)
+                break;
+            /* Timers too far in the future are parked in the last slot of
+               the top level and re-placed when it's cascaded. */
+            if(level == DILL_WHEEL_LEVELS - 1) {
+                slot = cur + DILL_WHEEL_SLOTS - 1;
+                break;
+            }
+            ++level;
+        }
+    }
+    int idx = slot & DILL_WHEEL_MASK;
+    struct dill_list *lst = &dill_wheel.slots[level][idx];
+    dill_wheel.occupied[level] |= (uint64_t)1 << idx;
+    tm->slot = lst;
+    if(level) {
+        dill_list_insert(lst, &tm->item, NULL);
+        return;
+    }
+    /* Level 0 slot is kept ordered. All the timers in a slot expire at the
+       same time, except for the current slot which may contain timers that
+       are already overdue. Timers coming from higher levels were typically
+       created earlier than those added directly so the walk is short. */
+    struct dill_list_item *it = lst->last;
     while(it) {
-        struct dill_timer *tm = dill_cont(it, struct dill_timer, item);
-        /* If multiple timers expire at the same momemt they will be fired
-           in the order they were created in (> rather than >=). */
-        if(tm->expiry > timer->expiry)
+        struct dill_timer *t = dill_cont(it, struct dill_timer, item);
+        if(t->expiry < tm->expiry ||
+              (t->expiry == tm->expiry && t->seq < tm->seq))
+            break;
+        it = it->prev;
+    }
+    dill_list_insert(lst, &tm->item, it ? it->next : dill_list_begin(lst));
+}
+
+/* Moves the wheel to time 'tm' and cascades the slots that start at that
+   point in time. */
+static void dill_wheel_advance(int64_t tm) {
+    dill_wheel.now = tm;
+    int level = 1;
+    while(level < DILL_WHEEL_LEVELS &&
+          !(tm & (((int64_t)1 << (level * DILL_WHEEL_BITS)) - 1)))
+        ++level;
+    for(--level; level > 0; --level) {
+        int idx = (tm >> (level * DILL_WHEEL_BITS)) & DILL_WHEEL_MASK;
+        if(!(dill_wheel.occupied[level] & ((uint64_t)1 << idx)))
+            continue;
+        /* Detach the content of the slot first as timers parked in the top
+           level may get back to the same slot. */
+        struct dill_list lst = dill_wheel.slots[level][idx];
+        dill_list_init(&dill_wheel.slots[level][idx]);
+        dill_wheel.occupied[level] &= ~((uint64_t)1 << idx);
+        struct dill_list_item *it = dill_list_begin(&lst);
+        while(it) {
+            struct dill_list_item *next = dill_list_next(it);
+            struct dill_timer *t = dill_cont(it, struct dill_timer, item);
+            /* This is where removed timers get dropped in bulk. */
+            if(t->dead) {
+                dill_list_item_init(&t->item);
+                t->slot = NULL;
+                t->dead = 0;
+            }
+            else
+                dill_wheel_place(t);
+            it = next;
+        }
+    }
+}
+
+/* Returns the earliest point in time when the wheel has to be processed.
+   There's no need to process it before the specified time. If 'exact' is
+   set, small slots at higher levels are inspected to get the exact time
+   of the next expiry rather than the time of the cascade. */
+static int64_t dill_wheel_next(int64_t from, int exact) {
+    int64_t next = INT64_MAX;
+    int level;
+    for(level = 0; level != DILL_WHEEL_LEVELS; ++level) {
+        uint64_t occupied = dill_wheel.occupied[level];
+        if(!occupied)
+            continue;
+        int idx = dill_wheel_first(occupied, dill_wheel_start(level));
+        int64_t tm = dill_wheel_time(level, idx);
+        if(tm < from) {
+            /* Only possible for the current level 0 slot. */
+            occupied &= ~((uint64_t)1 << idx);
+            if(!occupied)
+                continue;
+            idx = dill_wheel_first(occupied, idx);
+            tm = dill_wheel_time(level, idx);
+        }
+        if(tm >= next)
+            continue;
+        if(level && exact) {
+            /* Find the earliest expiry in the slot. */
+            struct dill_list_item *it =
+                dill_list_begin(&dill_wheel.slots[level][idx]);
+            int64_t expiry = INT64_MAX;
+            int n = 0;
+            for(; it && n != DILL_WHEEL_SCAN; it = dill_list_next(it), ++n) {
+                struct dill_timer *t = dill_cont(it, struct dill_timer, item);
+                if(!t->dead && t->expiry < expiry)
+                    expiry = t->expiry;
+            }
+            if(!it) {
+                /* Timers in other slots at this level can't expire before
+                   their slot is cascaded. */
+                occupied &= ~((uint64_t)1 << idx);
+                if(occupied) {
+                    int64_t tm2 = dill_wheel_time(level,
+                        dill_wheel_first(occupied, idx));
+                    if(tm2 < expiry)
+                        expiry = tm2;
+                }
+                tm = expiry;
+            }
+        }
+        if(tm < next)
+            next = tm;
+    }
+    return next;
+}
+
+struct timerstats dill_timer_stats = {0};
+
+/* Maximum number of timers fired by a single call to dill_timer_fire().
+   Zero means there's no limit. */
+static int dill_timer_budget = 0;
+
+int timerslack(int64_t slack) {
+    if(dill_slow(slack < 0 || slack > INT64_MAX / 1000)) {
+        errno = EINVAL; return -1;}
+    dill_running->slack = slack * 1000;
+    return 0;
+}
+
+int setdeadline(int64_t deadline) {
+    if(dill_slow(deadline < -1)) {errno = EINVAL; return -1;}
+    dill_running->ddline = dill_ms2us(deadline);
+    return 0;
+}
+
+int setdeadline_us(int64_t deadline) {
+    if(dill_slow(deadline < -1)) {errno = EINVAL; return -1;}
+    dill_running->ddline = deadline;
+    return 0;
+}
+
+int64_t getdeadline(void) {
+    return dill_us2ms(dill_running->ddline);
+}
+
+int64_t getdeadline_us(void) {
+    return dill_running->ddline;
+}
+
+int timerbudget(int budget) {
+    if(dill_slow(budget < 0)) {errno = EINVAL; return -1;}
+    dill_timer_budget = budget;
+    return 0;
+}
+
+int timerstats(struct timerstats *stats) {
+    if(dill_slow(!stats)) {errno = EINVAL; return -1;}
+    *stats = dill_timer_stats;
+    return 0;
+}
+
+void dill_timer_add(struct dill_timer *timer, int64_t deadline) {
+    dill_timer_add_us(timer, dill_ms2us(deadline));
+}
+
+/* Unlinks the timer from its slot. */
+static void dill_wheel_unlink(struct dill_timer *timer) {
+    dill_list_erase(timer->slot, &timer->item);
+    if(dill_list_empty(timer->slot)) {
+        int pos = timer->slot - &dill_wheel.slots[0][0];
+        dill_wheel.occupied[pos / DILL_WHEEL_SLOTS] &=
+            ~((uint64_t)1 << (pos % DILL_WHEEL_SLOTS));
+    }
+    timer->slot = NULL;
+    timer->dead = 0;
+}
+
+/* Unlinks all the timers from the wheel except for those in slot 'keep'.
+   Returns 1 if the wheel is empty afterwards. */
+static int dill_wheel_clear(struct dill_list *keep) {
+    uint64_t left = 0;
+    int level;
+    for(level = 0; level != DILL_WHEEL_LEVELS; ++level) {
+        uint64_t bits = dill_wheel.occupied[level];
+        while(bits) {
+            struct dill_list *lst =
+                &dill_wheel.slots[level][__builtin_ctzll(bits)];
+            bits &= bits - 1;
+            while(lst != keep && !dill_list_empty(lst))
+                dill_wheel_unlink(dill_cont(dill_list_begin(lst),
+                    struct dill_timer, item));
+        }
+        left |= dill_wheel.occupied[level];
+    }
+    return !left;
+}
+
+/* Unlinks removed timers from the first non-empty slot at level 0 so that
+   they don't cause spurious wakeups. Each timer is unlinked once so the
+   cost is amortised over the calls to dill_timer_rm(). */
+static void dill_wheel_prune(void) {
+    while(dill_wheel.occupied[0]) {
+        int idx = dill_wheel_first(dill_wheel.occupied[0],
+            dill_wheel_start(0));
+        struct dill_list *lst = &dill_wheel.slots[0][idx];
+        struct dill_list_item *it = dill_list_begin(lst);
+        while(it) {
+            struct dill_list_item *next = dill_list_next(it);
+            struct dill_timer *t = dill_cont(it, struct dill_timer, item);
+            if(t->dead)
+                dill_wheel_unlink(t);
+            it = next;
+        }
+        if(!dill_list_empty(lst))
             break;
-        it = dill_list_next(it);
     }
-    dill_list_insert(&dill_timers, &timer->item, it);
+}
+
+void dill_timer_add_us(struct dill_timer *timer, int64_t deadline) {
+    dill_assert(deadline >= 0);
+    /* Coalesce coroutines' timers by rounding the deadline up to the slack. */
+    int64_t slack = timer->cb ? 0 :
+        dill_cont(timer, struct dill_cr, timer)->slack;
+    if(slack > 1 && deadline <= INT64_MAX - slack)
+        deadline = (deadline + slack - 1) / slack * slack;
+    if(timer->slot) {
+        dill_assert(timer->dead);
+        /* The timer was removed but it's still in the wheel. If the deadline
+           is the same it can stay in its slot, unless it's a level 0 slot
+           where it would get ahead of the timers added in the meantime or
+           the slot won't be processed till after the deadline. */
+        int pos = timer->slot - &dill_wheel.slots[0][0];
+        if(timer->expiry == deadline && (!timer->item.next ||
+              pos >= DILL_WHEEL_SLOTS) && dill_wheel_time(pos /
+              DILL_WHEEL_SLOTS, pos % DILL_WHEEL_SLOTS) <= deadline) {
+            timer->dead = 0;
+            timer->seq = dill_wheel.seq++;
+            ++dill_wheel.count;
+            return;
+        }
+        dill_wheel_unlink(timer);
+    }
+    /* Empty wheel can be moved to the current time. The removed timers
+       have to go first as their slots may be left behind. The current slot
+       is left alone as dill_timer_fire() may be processing it. */
+    if(!dill_wheel.count && dill_wheel_clear(
+          &dill_wheel.slots[0][dill_wheel.now & DILL_WHEEL_MASK]))
+        dill_wheel.now = dill_now_us();
+    timer->expiry = deadline;
+    /* If multiple timers expire at the same moment they will be fired
+       in the order they were created in. */
+    timer->seq = dill_wheel.seq++;
+    dill_wheel_place(timer);
+    ++dill_wheel.count;
 }
 
 void dill_timer_rm(struct dill_timer *timer) {
-    dill_list_erase(&dill_timers, &timer->item);
+    if(!timer->slot || timer->dead)
+        return;
+    timer->dead = 1;
+    --dill_wheel.count;
+}
+
+void dill_timer_purge(struct dill_timer *timer) {
+    if(!timer->slot)
+        return;
+    if(!timer->dead)
+        --dill_wheel.count;
+    dill_wheel_unlink(timer);
 }
 
-int dill_timer_next(void) {
-    if(dill_list_empty(&dill_timers))
+int64_t dill_timer_next(void) {
+    if(!dill_wheel.count)
         return -1;
-    int64_t nw = now();
-    int64_t expiry = dill_cont(dill_list_begin(&dill_timers),
-        struct dill_timer, item)->expiry;
-    return (int) (nw >= expiry ? 0 : expiry - nw);
+    dill_wheel_prune();
+    int64_t nw = dill_now_us();
+    int64_t expiry = dill_wheel_next(dill_wheel.now, 1);
+    return nw >= expiry ? 0 : expiry - nw;
 }
 
 int dill_timer_fire(void) {
     /* Avoid getting current time if there are no timers anyway. */
-    if(dill_list_empty(&dill_timers))
+    if(!dill_wheel.count)
         return 0;
-    int64_t nw = now();
+    int64_t nw = dill_now_us();
     int fired = 0;
-    while(!dill_list_empty(&dill_timers)) {
-        struct dill_timer *tm = dill_cont(
-            dill_list_begin(&dill_timers), struct dill_timer, item);
-        if(tm->expiry > nw)
+    int n = 0;
+    while(1) {
+        int idx = dill_wheel.now & DILL_WHEEL_MASK;
+        struct dill_list *lst = &dill_wheel.slots[0][idx];
+        while(!dill_list_empty(lst)) {
+            struct dill_timer *tm = dill_cont(dill_list_begin(lst),
+                struct dill_timer, item);
+            if(tm->dead) {
+                dill_wheel_unlink(tm);
+                continue;
+            }
+            /* The rest of the expired timers stays in place. The poller won't
+               block until they are fired. */
+            if(dill_slow(dill_timer_budget && n == dill_timer_budget)) {
+                ++dill_timer_stats.deferred;
+                return fired;
+            }
+            ++n;
+            dill_list_erase(lst, &tm->item);
+            tm->slot = NULL;
+            --dill_wheel.count;
+            ++dill_timer_stats.fired;
+            if(dill_slow(tm->cb)) {
+                if(tm->cb(tm))
+                    fired = 1;
+                continue;
+            }
+            dill_resume(dill_cont(tm, struct dill_cr, timer), -ETIMEDOUT);
+            fired = 1;
+        }
+        dill_wheel.occupied[0] &= ~((uint64_t)1 << idx);
+        /* The wheel stays at the current time so that timers added later on
+           with the same or earlier deadline fire on the next pass. */
+        if(dill_wheel.now >= nw)
             break;
-        dill_list_erase(&dill_timers, dill_list_begin(&dill_timers));
-        dill_resume(dill_cont(tm, struct dill_cr, timer), -ETIMEDOUT);
-        fired = 1;
+        /* Skip the empty slots. */
+        int64_t next = dill_wheel_next(dill_wheel.now + 1, 0);
+        dill_wheel_advance(next > nw ? nw : next);
     }
     return fired;
 }
 
 void dill_timer_postfork(void) {
-    dill_list_init(&dill_timers);
+    /* The timers of the parent's coroutines must not point into the wheel. */
+    dill_wheel_clear(NULL);
+    memset(&dill_wheel, 0, sizeof(dill_wheel));
 }
 
@@ -30,24 +30,74 @@
 #include "list.h"
 
 struct dill_timer {
-    /* Item in the global list of all timers. */
+    /* Item in the timing wheel slot the timer is currently in. */
     struct dill_list_item item;
-    /* The deadline when the timer expires. */
+    /* The slot itself. NULL if the timer is not in the wheel. */
+    struct dill_list *slot;
+    /* Set if the timer was removed but is still linked to the slot. */
+    int dead;
+    /* The deadline when the timer expires, in microseconds. */
     int64_t expiry;
+    /* Timers with the same expiry are fired in the order of this number. */
+    uint64_t seq;
+    /* If set, called when the timer expires. Returns 1 if it has resumed
+       any coroutines, 0 otherwise. If not set, the timer belongs to
+       a coroutine which is resumed with ETIMEDOUT. */
+    int (*cb)(struct dill_timer *timer);
 };
 
+/* Initialise an inactive timer. */
+static inline void dill_timer_init(struct dill_timer *timer,
+      int (*cb)(struct dill_timer *timer)) {
+    timer->slot = NULL;
+    timer->dead = 0;
+    timer->cb = cb;
+}
+
+/* Set if the time is virtual. See dovirtualtime(). */
+extern int dill_timer_virtual;
+
+/* Moves the virtual clock forward by 'us' microseconds. */
+void dill_timer_jump(int64_t us);
+
+/* Statistics exposed via timerstats(). */
+extern struct timerstats dill_timer_stats;
+
+/* Converts a deadline in milliseconds to microseconds. Infinite deadline
+   (-1) stays infinite. */
+static inline int64_t dill_ms2us(int64_t deadline) {
+    if(deadline < 0) return -1;
+    return deadline > INT64_MAX / 1000 ? INT64_MAX : deadline * 1000;
+}
+
+/* And back, rounding up so that the deadline is never shortened. */
+static inline int64_t dill_us2ms(int64_t deadline) {
+    if(deadline < 0) return -1;
+    return deadline / 1000 + (deadline % 1000 ? 1 : 0);
+}
+
 /* Add a timer for the running coroutine. */
 void dill_timer_add(struct dill_timer *timer, int64_t deadline);
 
-/* Remove the timer associated with the running coroutine. */
+/* Same as above, with the deadline in microseconds. */
+void dill_timer_add_us(struct dill_timer *timer, int64_t deadline);
+
+/* Remove the timer associated with the running coroutine. The timer is only
+   marked as removed. It is unlinked later on or reused if it is re-added
+   with the same deadline. */
 void dill_timer_rm(struct dill_timer *timer);
 
-/* Number of milliseconds till the next timer expires.
+/* Remove the timer from the wheel straight away. Must be called before the
+   memory holding the timer is deallocated. */
+void dill_timer_purge(struct dill_timer *timer);
+
+/* Number of microseconds till the next timer expires.
    If there are no timers returns -1. */
-int dill_timer_next(void);
+int64_t dill_timer_next(void);
 
-/* Resumes all coroutines whose timers have already expired.
-   Returns zero if no coroutine was resumed, 1 otherwise. */
+/* Resumes coroutines whose timers have already expired, at most as many as
+   the timer budget allows. Returns zero if no coroutine was resumed,
+   1 otherwise. */
 int dill_timer_fire(void);
 
 /* Called after fork in the child process to deactivate all the timers